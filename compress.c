@@ -0,0 +1,380 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/xarray.h>
+#include <linux/math64.h>
+#include <crypto/acompress.h>
+#include "compress.h"
+#include "dedup.h"
+
+
+static struct crypto_acomp *scull_tfm;   /* shared by every device, NULL if unavailable */
+
+
+static inline scull_zq *scull_zq_ptr(void *q)
+{
+    return (scull_zq *)((unsigned long)q & ~SCULL_ZQ_TAG);
+} // scull_zq_ptr()
+
+
+// scull_compress_init
+void scull_compress_init(const char *alg)
+{
+    struct crypto_acomp *tfm = crypto_alloc_acomp(alg, 0, 0);
+
+    if (IS_ERR(tfm)) {
+        printk(KERN_INFO "scull: compressor %s unavailable (%ld)\n", alg, PTR_ERR(tfm));
+        return;
+    } // if
+    scull_tfm = tfm;
+} // scull_compress_init()
+
+
+// scull_compress_exit
+void scull_compress_exit(void)
+{
+    if (scull_tfm) crypto_free_acomp(scull_tfm);
+    scull_tfm = NULL;
+} // scull_compress_exit()
+
+
+// scull_zq_run
+// one synchronous pass through the compressor on linear buffers
+// on success *dlen is the number of bytes written to dst
+static int scull_zq_run(bool comp, const void *src, unsigned int slen, void *dst,
+                        unsigned int *dlen)
+{
+    struct acomp_req *req = acomp_request_alloc(scull_tfm);
+    DECLARE_CRYPTO_WAIT(wait);
+    int err;
+
+    if (!req) return -ENOMEM;
+    acomp_request_set_callback(req, CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done, &wait);
+    acomp_request_set_src_nondma(req, src, slen);
+    acomp_request_set_dst_nondma(req, dst, *dlen);
+    err = crypto_wait_req(comp ? crypto_acomp_compress(req) : crypto_acomp_decompress(req),
+                          &wait);
+    *dlen = req->dlen;
+    acomp_request_free(req);
+    return err;
+} // scull_zq_run()
+
+
+// scull_zq_deflate
+// compress quantum q of a cold qset into a new compressed copy, quanta that
+// are mapped or spliced, shared by dedup, came from the vzalloc fallback,
+// or don't shrink by at least a quarter are left alone
+// caller holds qs->lock so no writer changes the quantum underneath
+// returns the tagged copy for scull_zq_swap, or NULL
+static void *scull_zq_deflate(scull_dev *dev, void *q, void *buf, gfp_t gfp)
+{
+    int quantum = dev->quantum;
+    unsigned int dlen = quantum;
+    u64 start;
+    scull_zq *zq;
+    int err;
+
+    if (!q || scull_is_zq(q) || scull_is_dq(q) || is_vmalloc_addr(q)) return NULL;
+    if (folio_ref_count(virt_to_folio(q)) > 1) return NULL;
+
+    start = ktime_get_ns();
+    err = scull_zq_run(true, q, quantum, buf, &dlen);
+    atomic64_add(ktime_get_ns() - start, &dev->zq_compress_ns);
+    atomic64_inc(&dev->zq_compress_ops);
+    if (err || dlen > quantum - quantum / 4) {
+        atomic64_inc(&dev->zq_rejects);
+        return NULL;
+    } // if
+
+    zq = kmalloc(struct_size(zq, data, dlen), gfp | __GFP_NOWARN);
+    if (!zq) return NULL;
+    zq->len = dlen;
+    memcpy(zq->data, buf, dlen);
+    return (void *)((unsigned long)zq | SCULL_ZQ_TAG);
+} // scull_zq_deflate()
+
+
+// scull_zq_swap
+// put the compressed copy of q in slot i, unless the slot no longer holds
+// q or its page got mapped in the meantime
+// under reclaim the quantum goes straight back to the page allocator, the
+// pool would only keep what the shrinker reports as freed
+// caller must hold dev->sem and every stripe for writing so no reader
+// still holds the quantum, returns the bytes saved
+static long scull_zq_swap(scull_dev *dev, scull_qset *qs, int i, void *q, void *copy, bool reclaim)
+{
+    scull_zq *zq = scull_zq_ptr(copy);
+
+    if (qs->data[i] != q || folio_ref_count(virt_to_folio(q)) > 1) {
+        kfree(zq);
+        return 0;
+    } // if
+    qs->data[i] = copy;
+    if (reclaim) {
+        scull_uncharge(dev, q);
+        scull_release_quantum(q);
+    } else {
+        scull_free_quantum(dev, q, dev->quantum);
+    } // if
+    atomic64_inc(&dev->zq_count);
+    atomic64_add(zq->len, &dev->zq_stored);
+    return dev->quantum - zq->len;
+} // scull_zq_swap()
+
+
+// scull_zq_inflate
+// the fresh quantum is published with a release store, so lockless
+// readers in scull_get_quantum see it fully decompressed
+// it is sized and allocated by dev, whose geometry the qset was made
+// with, the owner of a snapshot's shared qset may have been trimmed to
+// another quantum size already, so only the charge moves over to it
+// the data is already stored, so a full quota doesn't stop it coming back,
+// otherwise reads of compressed quanta would fail once writers fill it
+void *scull_zq_inflate(scull_dev *dev, scull_qset *qs, int i)
+{
+    void *q = qs->data[i];
+    unsigned int dlen = dev->quantum;
+    scull_zq *zq;
+    u64 start;
+    int err;
+
+    if (!scull_is_zq(q)) return q;
+    zq = scull_zq_ptr(q);
+    q = scull_alloc_quantum(dev, (unsigned long)qs->index * dev->qset + i, true);
+    if (!q) return ERR_PTR(-ENOMEM);
+
+    start = ktime_get_ns();
+    err = scull_zq_run(false, zq->data, zq->len, q, &dlen);
+    atomic64_add(ktime_get_ns() - start, &dev->zq_decompress_ns);
+    atomic64_inc(&dev->zq_decompress_ops);
+    if (err || dlen != dev->quantum) {
+        scull_free_quantum(dev, q, dev->quantum);
+        return ERR_PTR(err ? err : -EIO);
+    } // if
+    /* in a snapshot's shared qset the quantum is charged to the qset's owner */
+    if (qs->owner != dev) {
+        scull_uncharge(dev, q);
+        if (qs->owner) scull_charge(qs->owner, q);
+    } // if
+
+    smp_store_release(&qs->data[i], q);
+    scull_zq_free(dev, (void *)((unsigned long)zq | SCULL_ZQ_TAG));
+    return q;
+} // scull_zq_inflate()
+
+
+// scull_zq_free
+void scull_zq_free(scull_dev *dev, void *q)
+{
+    scull_zq *zq = scull_zq_ptr(q);
+
+    atomic64_dec(&dev->zq_count);
+    atomic64_sub(zq->len, &dev->zq_stored);
+    kfree(zq);
+} // scull_zq_free()
+
+
+// scull_zq_dup
+void *scull_zq_dup(scull_dev *dev, void *q)
+{
+    scull_zq *zq = scull_zq_ptr(q);
+    scull_zq *copy = kmemdup(zq, struct_size(zq, data, zq->len), GFP_KERNEL);
+
+    if (!copy) return NULL;
+    atomic64_inc(&dev->zq_count);
+    atomic64_add(copy->len, &dev->zq_stored);
+    return (void *)((unsigned long)copy | SCULL_ZQ_TAG);
+} // scull_zq_dup()
+
+
+// scull_zq_read
+// decompress a tagged slot into buf without changing the qset
+int scull_zq_read(void *q, void *buf, int quantum)
+{
+    scull_zq *zq = scull_zq_ptr(q);
+    unsigned int dlen = quantum;
+    int err;
+
+    if (!scull_tfm) return -EIO;
+    err = scull_zq_run(false, zq->data, zq->len, buf, &dlen);
+    if (err) return err;
+    return dlen == quantum ? 0 : -EIO;
+} // scull_zq_read()
+
+
+// scull_compress_squeeze
+// compress up to n quanta of qs from slot *slot on, with only the qset lock
+// held, into copies that scull_compress_pass swaps in later
+// *slot reaches dev->qset once the qset has nothing more to give
+// caller holds dev->sem for reading and qs->lock, returns the copies made
+static int scull_compress_squeeze(scull_dev *dev, scull_qset *qs, unsigned long cold, int *slot,
+                                  int n, scull_zq_batch *b, void *buf, gfp_t gfp)
+{
+    int nr = 0;
+
+    /* qsets shared with a snapshot are read by other devices */
+    if (!qs->data || qs->ref != 1 || time_after(qs->atime, cold)) {
+        *slot = dev->qset;
+        return 0;
+    } // if
+    for (; *slot < dev->qset && nr < n; ++*slot) {
+        void *q = qs->data[*slot];
+        void *copy = scull_zq_deflate(dev, q, buf, gfp);
+
+        if (!copy) continue;
+        b->slot[nr] = *slot;
+        b->q[nr] = q;
+        b->copy[nr++] = copy;
+    } // for
+    return nr;
+} // scull_compress_squeeze()
+
+
+// scull_compress_pass
+// walk the qsets under the read lock looking for ones untouched since cold
+// a cold qset is compressed SCULL_ZQ_BATCH quanta at a time under its own
+// lock and dev->sem for reading, and the write lock is only taken to swap
+// the copies in, so readers and writers never wait behind the compressor
+// a batch is thrown away if the qset was touched or the device trimmed
+// while no lock was held
+// the walk stops early once budget quanta were compressed or the quantum
+// size changes under it, with trylock set a busy device is skipped instead
+// of waited for, returns the bytes saved
+static long scull_compress_pass(scull_dev *dev, unsigned long cold, long budget, bool trylock)
+{
+    int quantum = READ_ONCE(dev->quantum), slot = 0;
+    unsigned long idx = 0;
+    long saved = 0, nr = 0;
+    gfp_t gfp = trylock ? GFP_NOWAIT : GFP_KERNEL;
+    void *buf = kvmalloc(quantum, gfp | __GFP_NOWARN);
+    scull_zq_batch *b = kmalloc(sizeof(*b), gfp | __GFP_NOWARN);
+
+    while (buf && b && nr < budget) {
+        scull_qset *qs;
+        unsigned long gen;
+        bool cold_qs;
+        int n = 0, qset;
+
+        if (!trylock) down_read(&dev->sem);
+        else if (!down_read_trylock(&dev->sem)) break;
+        qs = xa_find(dev->qsets, &idx, ULONG_MAX, XA_PRESENT);
+        if (!qs || dev->quantum != quantum) {
+            up_read(&dev->sem);
+            break;
+        } // if
+        gen = atomic_long_read(&dev->gen);
+        qset = dev->qset;
+        cold_qs = !time_after(READ_ONCE(qs->atime), cold);
+        if (cold_qs && trylock) cold_qs = mutex_trylock(&qs->lock);
+        else if (cold_qs) mutex_lock(&qs->lock);
+        if (cold_qs) {
+            n = scull_compress_squeeze(dev, qs, cold, &slot, min_t(long, SCULL_ZQ_BATCH, budget - nr),
+                                       b, buf, gfp);
+            mutex_unlock(&qs->lock);
+        } else {
+            slot = qset;
+        } // if
+        up_read(&dev->sem);
+
+        if (n) {
+            bool locked = true;
+
+            if (!trylock) {
+                down_write(&dev->sem);
+                scull_stripes_lock(dev);
+            } else if (!down_write_trylock(&dev->sem)) {
+                locked = false;
+            } else if (!scull_stripes_trylock(dev)) {
+                up_write(&dev->sem);
+                locked = false;
+            } // if
+            /* a trim bumps gen, any access since the squeeze bumps atime */
+            if (locked && atomic_long_read(&dev->gen) == gen && xa_load(dev->qsets, idx) == qs &&
+                qs->ref == 1 && !time_after(qs->atime, cold)) {
+                for (int k = 0; k < n; k++) {
+                    long got = scull_zq_swap(dev, qs, b->slot[k], b->q[k], b->copy[k], trylock);
+                    saved += got;
+                    nr += got > 0;
+                } // for
+                n = 0;
+            } // if
+            if (locked) {
+                scull_stripes_unlock(dev);
+                up_write(&dev->sem);
+            } // if
+            while (n--) kfree(scull_zq_ptr(b->copy[n]));
+            if (!locked) break;
+        } // if
+        if (slot >= qset) {
+            idx++;
+            slot = 0;
+        } // if
+        if (!trylock) cond_resched();
+    } // while
+    kfree(b);
+    kvfree(buf);
+    return saved;
+} // scull_compress_pass()
+
+
+// scull_compress_work
+// the periodic cold scan, compresses qsets idle for the configured interval
+void scull_compress_work(struct work_struct *work)
+{
+    scull_dev *dev = container_of(to_delayed_work(work), scull_dev, compress_work);
+    unsigned int ms = READ_ONCE(dev->compress_ms);
+
+    if (!ms) return;
+    scull_compress_pass(dev, jiffies - msecs_to_jiffies(ms), LONG_MAX, false);
+    queue_delayed_work(scull_wq, &dev->compress_work, msecs_to_jiffies(ms));
+} // scull_compress_work()
+
+
+// scull_compress_reclaim
+// shrinker entry, squeezes up to nr quanta idle for at least a second even
+// when the periodic scan is off, never blocks on dev->sem
+long scull_compress_reclaim(scull_dev *dev, long nr)
+{
+    if (!scull_tfm) return 0;
+    return scull_compress_pass(dev, jiffies - HZ, nr, true);
+} // scull_compress_reclaim()
+
+
+// scull_compress_count
+// shrinker estimate of the quanta scull_compress_reclaim could squeeze,
+// the quanta of unshared qsets idle for a second, capped by what is charged
+// and scaled by how often compression has paid off so far
+// a busy device counts nothing rather than waiting for dev->sem
+long scull_compress_count(scull_dev *dev)
+{
+    s64 ops = atomic64_read(&dev->zq_compress_ops), rejects = atomic64_read(&dev->zq_rejects);
+    unsigned long idx, cold = jiffies - HZ;
+    scull_qset *qs;
+    long nr = 0;
+
+    if (!scull_tfm || !down_read_trylock(&dev->sem)) return 0;
+    xa_for_each(dev->qsets, idx, qs) {
+        if (qs->data && READ_ONCE(qs->ref) == 1 && !time_after(READ_ONCE(qs->atime), cold))
+            nr += dev->qset;
+    } // xa_for_each
+    nr = min(nr, max(scull_nr_quanta(dev), 0L));
+    up_read(&dev->sem);
+    if (ops > 0) nr = div64_s64((s64)nr * max_t(s64, ops - rejects, 0), ops);
+    return nr;
+} // scull_compress_count()
+
+
+// scull_set_compress
+int scull_set_compress(scull_dev *dev, unsigned int ms)
+{
+    if (ms && !scull_tfm) return -EOPNOTSUPP;
+    WRITE_ONCE(dev->compress_ms, ms);
+    if (ms)
+        mod_delayed_work(scull_wq, &dev->compress_work, msecs_to_jiffies(ms));
+    else
+        cancel_delayed_work_sync(&dev->compress_work);
+    return 0;
+} // scull_set_compress()
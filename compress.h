@@ -0,0 +1,61 @@
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include "util.h"
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+# define SCULL_ZQ_TAG 1UL /* low bit of a qset slot marks a compressed quantum */
+# define SCULL_ZQ_BATCH 16 /* quanta compressed per trip to the write lock */
+
+
+// a cold quantum squeezed by the crypto compressor, kept in the kmalloc
+// size class closest to its compressed length and swapped back for a
+// real quantum on the next access
+typedef struct scull_zq {
+    unsigned int len;        /* compressed bytes in data */
+    u8 data[];
+} scull_zq; // struct scull_zq
+
+
+// compressed copies waiting for the write lock to be swapped in
+typedef struct scull_zq_batch {
+    int slot[SCULL_ZQ_BATCH];
+    void *q[SCULL_ZQ_BATCH];     /* quantum each copy was made from */
+    void *copy[SCULL_ZQ_BATCH];  /* tagged scull_zq */
+} scull_zq_batch; // struct scull_zq_batch
+
+
+static inline bool scull_is_zq(const void *q)
+{
+    return (unsigned long)q & SCULL_ZQ_TAG;
+} // scull_is_zq()
+
+
+// load the compressor named by the scull_compressor parameter
+// the driver keeps working without one, SCULL_IOC_SET_COMPRESS then fails
+void scull_compress_init(const char *);
+void scull_compress_exit(void);
+
+// start, retune or stop (0 ms) the cold scan of a device, and stop it
+// for good before the device is freed
+int scull_set_compress(struct scull_dev *, unsigned int);
+void scull_compress_work(struct work_struct *);
+
+// memory pressure, compress up to nr cold quanta without blocking, returns
+// bytes saved, and an estimate of how many quanta that could reach
+long scull_compress_reclaim(struct scull_dev *, long);
+long scull_compress_count(struct scull_dev *);
+
+// swap slot i of a qset back to a plain quantum, caller holds qs->lock
+// or dev->sem for writing, returns an ERR_PTR if that fails
+void *scull_zq_inflate(struct scull_dev *, struct scull_qset *, int);
+
+// drop or duplicate a compressed slot, caller holds dev->sem
+void scull_zq_free(struct scull_dev *, void *);
+void *scull_zq_dup(struct scull_dev *, void *);
+
+// decompress a slot into a quantum sized buffer, leaving the slot as it is
+int scull_zq_read(void *, void *, int);
+
+# endif
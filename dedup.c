@@ -0,0 +1,316 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/rhashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/llist.h>
+#include <linux/xarray.h>
+#include <linux/xxhash.h>
+#include "dedup.h"
+
+
+// one shareable quantum, owned by the table and referenced from qset slots
+// its contents never change while it is in the table, a writer either
+// takes it back when it holds the only reference or copies it
+// lookups run under RCU and take a reference with atomic_inc_not_zero, so
+// an entry whose count hit zero is on its way out and is skipped
+typedef struct scull_dq {
+    struct rhlist_head hnode; /* in scull_dq_table, when hashed */
+    u64 hash;                 /* xxh64 of the contents */
+    void *q;                  /* the quantum */
+    int quantum;              /* its size, only equal sizes are shared */
+    bool hashed;              /* snapshot references stay out of the table */
+    atomic_t ref;             /* slots pointing at it */
+    struct rcu_head rcu;
+} scull_dq; // struct scull_dq
+
+
+// a reference parked by scull_dq_retire until no reader can reach it
+typedef struct scull_dq_retired {
+    struct llist_node lnode;
+    void *q;                  /* private quantum, or tagged shared one */
+    scull_qset *qs;           /* or a qset shared with a snapshot */
+    int quantum;              /* geometry they were used with */
+    int qset;
+} scull_dq_retired; // struct scull_dq_retired
+
+
+// the table grows and shrinks with the number of shared quanta and locks
+// per bucket, so writers on different minors or quanta don't contend
+static const struct rhashtable_params scull_dq_params = {
+    .head_offset = offsetof(scull_dq, hnode),
+    .key_offset = offsetof(scull_dq, hash),
+    .key_len = sizeof(u64),
+    .automatic_shrinking = true,
+};
+
+static struct rhltable scull_dq_table;    /* xxh64 of the contents -> scull_dq */
+static DEFINE_XARRAY(scull_dq_pages);     /* pfn of a shared quantum -> scull_dq */
+static atomic64_t scull_dq_nr;            /* shared quanta in the table */
+static atomic64_t scull_dq_saved;         /* bytes saved by the extra references */
+
+
+// scull_dedup_init
+int scull_dedup_init(void)
+{
+    return rhltable_init(&scull_dq_table, &scull_dq_params);
+} // scull_dedup_init()
+
+
+// scull_dedup_exit
+// every device has been trimmed by now, so the table is empty
+void scull_dedup_exit(void)
+{
+    WARN_ON(atomic64_read(&scull_dq_nr));
+    rhltable_destroy(&scull_dq_table);
+    xa_destroy(&scull_dq_pages);
+} // scull_dedup_exit()
+
+
+// scull_dq_find
+static scull_dq *scull_dq_find(void *q)
+{
+    return xa_load(&scull_dq_pages, page_to_pfn(scull_quantum_page(q, 0)));
+} // scull_dq_find()
+
+
+// scull_dq_unhash
+// the last reference is being dropped or taken back, lookups that still
+// see the entry fail to take a reference, it is freed after a grace period
+static void scull_dq_unhash(scull_dq *dq)
+{
+    if (dq->hashed) rhltable_remove(&scull_dq_table, &dq->hnode, scull_dq_params);
+    xa_erase(&scull_dq_pages, page_to_pfn(scull_quantum_page(dq->q, 0)));
+    atomic64_dec(&scull_dq_nr);
+    kfree_rcu(dq, rcu);
+} // scull_dq_unhash()
+
+
+// scull_dq_lookup
+// a referenced entry holding the same contents as q, or NULL
+static scull_dq *scull_dq_lookup(void *q, int quantum, u64 hash)
+{
+    struct rhlist_head *list, *pos;
+    scull_dq *dq, *match = NULL;
+
+    rcu_read_lock();
+    list = rhltable_lookup(&scull_dq_table, &hash, scull_dq_params);
+    rhl_for_each_entry_rcu(dq, pos, list, hnode) {
+        if (dq->quantum != quantum || !atomic_inc_not_zero(&dq->ref)) continue;
+        /* the reference keeps the quantum from being freed while comparing */
+        atomic64_add(quantum, &scull_dq_saved);
+        if (!memcmp(dq->q, q, quantum)) {
+            match = dq;
+            break;
+        } // if
+        scull_dq_put(dq->q);
+    } // rhl_for_each_entry_rcu
+    rcu_read_unlock();
+    return match;
+} // scull_dq_lookup()
+
+
+// scull_dq_new
+// a table entry for quantum q holding ref references, hashed under hash
+// unless hashed is false, NULL if it can't be indexed
+static scull_dq *scull_dq_new(void *q, int quantum, u64 hash, bool hashed, int ref)
+{
+    scull_dq *dq = kmalloc(sizeof(*dq), GFP_KERNEL);
+    unsigned long pfn = page_to_pfn(scull_quantum_page(q, 0));
+
+    if (!dq) return NULL;
+    dq->hash = hash;
+    dq->q = q;
+    dq->quantum = quantum;
+    dq->hashed = hashed;
+    atomic_set(&dq->ref, ref);
+    if (xa_err(xa_store(&scull_dq_pages, pfn, dq, GFP_KERNEL))) {
+        kfree(dq);
+        return NULL;
+    } // if
+    if (hashed && rhltable_insert(&scull_dq_table, &dq->hnode, scull_dq_params)) {
+        xa_erase(&scull_dq_pages, pfn);
+        kfree(dq);
+        return NULL;
+    } // if
+    atomic64_inc(&scull_dq_nr);
+    return dq;
+} // scull_dq_new()
+
+
+// scull_dq_retire
+// readers of the device may still be copying from q or walking qs, so it
+// is only put once scull_dq_flush holds dev->sem for writing
+static int scull_dq_retire(scull_dev *dev, void *q, scull_qset *qs)
+{
+    scull_dq_retired *r = kmalloc(sizeof(*r), GFP_KERNEL);
+
+    if (!r) return -ENOMEM;
+    r->q = q;
+    r->qs = qs;
+    r->quantum = dev->quantum;
+    r->qset = dev->qset;
+    llist_add(&r->lnode, &dev->dq_retired);
+    if (atomic_inc_return(&dev->dq_nr_retired) >= SCULL_DQ_RETIRE_BATCH)
+        queue_work(scull_wq, &dev->dq_work);
+    return 0;
+} // scull_dq_retire()
+
+
+// scull_dq_retire_qset
+int scull_dq_retire_qset(scull_dev *dev, scull_qset *qs)
+{
+    return scull_dq_retire(dev, NULL, qs);
+} // scull_dq_retire_qset()
+
+
+// scull_dq_flush
+// caller holds dev->sem for writing
+void scull_dq_flush(scull_dev *dev)
+{
+    struct llist_node *list = llist_del_all(&dev->dq_retired);
+    scull_dq_retired *r, *tmp;
+
+    llist_for_each_entry_safe(r, tmp, list, lnode) {
+        if (r->qs)
+            scull_qset_put(dev, r->qs, r->quantum, r->qset);
+        else if (scull_is_dq(r->q))
+            scull_dq_put(scull_dq_ptr(r->q));
+        else
+            scull_free_quantum(dev, r->q, r->quantum);
+        atomic_dec(&dev->dq_nr_retired);
+        kfree(r);
+    } // llist_for_each_entry_safe
+} // scull_dq_flush()
+
+
+// scull_dq_retire_work
+void scull_dq_retire_work(struct work_struct *work)
+{
+    scull_dev *dev = container_of(work, scull_dev, dq_work);
+
+    down_write(&dev->sem);
+    scull_stripes_lock(dev);
+    scull_dq_flush(dev);
+    scull_stripes_unlock(dev);
+    up_write(&dev->sem);
+} // scull_dq_retire_work()
+
+
+// scull_dq_share
+// a match swaps the slot over to the shared quantum and retires the private
+// copy, otherwise the quantum itself moves into the table, which costs
+// readers nothing as the slot still points at the same memory
+// quanta that are mapped, spliced or vmalloc backed are left private, the
+// fault handlers take their page reference under qs->lock so a quantum
+// being mapped can't slip past the refcount check
+void scull_dq_share(scull_dev *dev, scull_qset *qs, int i)
+{
+    int quantum = dev->quantum;
+    void *q = qs->data[i];
+    scull_dq *match;
+    u64 hash;
+
+    if (!q || scull_is_dq(q) || is_vmalloc_addr(q)) return;
+    if (folio_ref_count(virt_to_folio(q)) > 1) return;
+
+    hash = xxh64(q, quantum, quantum);
+    atomic64_inc(&dev->dq_hashed);
+    match = scull_dq_lookup(q, quantum, hash);
+    if (match) {
+        if (scull_dq_retire(dev, q, NULL)) {
+            scull_dq_put(match->q);
+            return;
+        } // if
+        smp_store_release(&qs->data[i], (void *)((unsigned long)match->q | SCULL_DQ_TAG));
+        atomic64_inc(&dev->dq_hits);
+        return;
+    } // if
+
+    /* two writers of the same new contents may both get here, costing a share */
+    if (!scull_dq_new(q, quantum, hash, true, 1)) return;
+    scull_uncharge(dev, q);
+    smp_store_release(&qs->data[i], (void *)((unsigned long)q | SCULL_DQ_TAG));
+} // scull_dq_share()
+
+
+// scull_dq_get
+// take another reference on slot i for a copy of its qset, a plain
+// quantum first moves into the table by reference only, unhashed, and
+// stops being charged to the qset's owner
+// caller holds qs->lock, returns the tagged slot value or NULL
+void *scull_dq_get(scull_dev *dev, scull_qset *qs, int i)
+{
+    void *q = qs->data[i];
+
+    /* the slot holds a reference, so the count can't drop to zero here */
+    if (scull_is_dq(q)) {
+        atomic_inc(&scull_dq_find(scull_dq_ptr(q))->ref);
+        atomic64_add(dev->quantum, &scull_dq_saved);
+        return q;
+    } // if
+    if (!scull_dq_new(q, dev->quantum, 0, false, 2)) return NULL;
+    atomic64_add(dev->quantum, &scull_dq_saved);
+    if (qs->owner)
+        scull_uncharge(qs->owner, q);
+    q = (void *)((unsigned long)q | SCULL_DQ_TAG);
+    smp_store_release(&qs->data[i], q);
+    return q;
+} // scull_dq_get()
+
+
+// scull_dq_break
+// the only holder takes the quantum back out of the table in place, any
+// other holder copies it into a fresh quantum and retires its reference,
+// which it keeps until then so nobody else can take the original back
+// and write it under the copy
+void *scull_dq_break(scull_dev *dev, scull_qset *qs, int i)
+{
+    void *shared = scull_dq_ptr(qs->data[i]);
+    scull_dq *dq = scull_dq_find(shared);
+    void *q;
+
+    /* dropping the count to zero keeps lookups from taking new references */
+    if (atomic_cmpxchg(&dq->ref, 1, 0) == 1) {
+        scull_dq_unhash(dq);
+        scull_charge(dev, shared);
+        smp_store_release(&qs->data[i], shared);
+        return shared;
+    } // if
+
+    q = scull_alloc_quantum(dev, (unsigned long)qs->index * dev->qset + i, false);
+    if (!q) return ERR_PTR(-ENOMEM);
+    memcpy(q, shared, dev->quantum);
+    if (scull_dq_retire(dev, qs->data[i], NULL)) {
+        scull_free_quantum(dev, q, dev->quantum);
+        return ERR_PTR(-ENOMEM);
+    } // if
+    smp_store_release(&qs->data[i], q);
+    atomic64_inc(&dev->dq_breaks);
+    return q;
+} // scull_dq_break()
+
+
+// scull_dq_put
+void scull_dq_put(void *shared)
+{
+    scull_dq *dq = scull_dq_find(shared);
+    int quantum = dq->quantum;
+
+    /* once the count drops another holder may free dq at any time */
+    if (!atomic_dec_and_test(&dq->ref)) {
+        atomic64_sub(quantum, &scull_dq_saved);
+        return;
+    } // if
+    scull_dq_unhash(dq);
+    scull_release_quantum(shared);
+} // scull_dq_put()
+
+
+// scull_dq_totals
+void scull_dq_totals(u64 *nr, u64 *saved)
+{
+    *nr = atomic64_read(&scull_dq_nr);
+    *saved = atomic64_read(&scull_dq_saved);
+} // scull_dq_totals()
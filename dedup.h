@@ -0,0 +1,55 @@
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include "util.h"
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+# define SCULL_DQ_TAG 2UL /* second bit of a qset slot marks a shared quantum */
+# define SCULL_DQ_RETIRE_BATCH 64 /* retired quanta queued before a flush */
+
+
+static inline bool scull_is_dq(const void *q)
+{
+    return (unsigned long)q & SCULL_DQ_TAG;
+} // scull_is_dq()
+
+
+static inline void *scull_dq_ptr(void *q)
+{
+    return (void *)((unsigned long)q & ~SCULL_DQ_TAG);
+} // scull_dq_ptr()
+
+
+// module wide table of shared quanta keyed by content, so identical quanta
+// are shared across minors as well as within one
+int scull_dedup_init(void);
+void scull_dedup_exit(void);
+
+// share slot i of a qset, which was just written in full, with an
+// identical quantum or publish it as a new shareable one
+// caller holds qs->lock and dev->sem for reading
+void scull_dq_share(struct scull_dev *, struct scull_qset *, int);
+
+// copy on write, give slot i of a qset a private quantum again
+// caller holds qs->lock, returns an ERR_PTR if that fails
+void *scull_dq_break(struct scull_dev *, struct scull_qset *, int);
+
+// drop a device's reference to a shared slot, caller must hold dev->sem for
+// writing or otherwise know no reader of the device can still reach it
+void scull_dq_put(void *);
+
+// another reference to slot i for a snapshot's copy of the qset, caller
+// holds qs->lock, returns the tagged slot value or NULL
+void *scull_dq_get(struct scull_dev *, struct scull_qset *, int);
+
+// quanta a device stopped using while readers might still hold them are
+// parked until it can take dev->sem for writing
+int scull_dq_retire_qset(struct scull_dev *, struct scull_qset *);
+void scull_dq_retire_work(struct work_struct *);
+void scull_dq_flush(struct scull_dev *);
+
+// module wide totals for SCULL_IOC_GET_DEDUP_STATS
+void scull_dq_totals(u64 *, u64 *);
+
+# endif
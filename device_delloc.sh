@@ -3,10 +3,8 @@
 module="scull"
 device="scull"
 
-# Unload the module
+# Unload the module, udev removes the device nodes with the class devices
 sudo /sbin/rmmod $module
-
-# Remove device nodes
-sudo rm -f /dev/${device}[0-3]
+sudo udevadm settle
 
 echo "Value printed after running the command: $(ls -l /dev/ | grep 'scull')"
@@ -3,20 +3,16 @@
 module="scull"
 device="scull"
 mode="664"
-# invoke insmod with all arguments we got
+# invoke insmod with all arguments we got (e.g. scull_nr_devs=1024)
 # and use a pathname, as newer modutils don't look in . by default
 sudo /sbin/insmod ./$module.ko $* || exit 1
-# remove stale nodes
-rm -f /dev/${device}[0-3]
-major=$(awk "\$2==\"$module\" {print \$1}" /proc/devices)
-sudo mknod /dev/${device}0 c $major 0
-sudo mknod /dev/${device}1 c $major 1
-sudo mknod /dev/${device}2 c $major 2
-sudo mknod /dev/${device}3 c $major 3
+# the module registers a device class, udev creates /dev/${device}N and
+# /dev/${device}pipeN for every minor, wait for it to finish
+sudo udevadm settle
 # give appropriate group/permissions, and change the group.
 # Not all distributions have staff, some have "wheel" instead.
 # group="staff"
 # grep -q '^staff:' /etc/group || group="wheel"
-# chgrp $group /dev/${device}[0-3]
-# chmod $mode /dev/${device}[0-3]
+# chgrp $group /dev/${device}*
+# chmod $mode /dev/${device}*
 echo "Value printed after running the command: $(ls -l /dev/ | grep 'scull')"
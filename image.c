@@ -0,0 +1,302 @@
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/err.h>
+#include <linux/uio.h>
+#include <linux/bvec.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include "image.h"
+#include "compress.h"
+#include "dedup.h"
+
+
+// payload pages batched into one read or write of the image
+typedef struct scull_image_io {
+    struct file *file;
+    loff_t pos;              /* image offset of the first batched page */
+    int nr;                  /* pages batched */
+    struct bio_vec bv[SCULL_IMAGE_BATCH];
+} scull_image_io; // struct scull_image_io
+
+
+// scull_image_flush
+// move the batched pages straight between the quanta and the image file,
+// looping over short transfers, running out of image is an error
+static int scull_image_flush(scull_image_io *io, bool save)
+{
+    struct iov_iter iter;
+
+    if (!io->nr) return 0;
+    iov_iter_bvec(&iter, save ? ITER_SOURCE : ITER_DEST, io->bv, io->nr,
+                  (size_t)io->nr * PAGE_SIZE);
+    io->nr = 0;
+    while (iov_iter_count(&iter)) {
+        ssize_t ret = save ? vfs_iter_write(io->file, &iter, &io->pos, 0)
+                           : vfs_iter_read(io->file, &iter, &io->pos, 0);
+        if (ret < 0) return ret;
+        if (!ret) return -EIO;
+        cond_resched();
+    } // while
+    return 0;
+} // scull_image_flush()
+
+
+// scull_image_add
+// queue every page of a quantum, flushing whenever the batch fills up
+static int scull_image_add(scull_image_io *io, void *q, int quantum, bool save)
+{
+    for (long off = 0; off < quantum; off += PAGE_SIZE) {
+        if (io->nr == SCULL_IMAGE_BATCH) {
+            int err = scull_image_flush(io, save);
+            if (err) return err;
+        } // if
+        bvec_set_page(&io->bv[io->nr++], scull_quantum_page(q, off), PAGE_SIZE, 0);
+    } // for
+    return 0;
+} // scull_image_add()
+
+
+// scull_image_next
+// slot of the first populated quantum at or after *qi that lies within the
+// device size, *qi is moved to it, missing qsets are skipped with xa_find
+static void *scull_image_next(scull_dev *dev, unsigned long *qi)
+{
+    unsigned long last = DIV_ROUND_UP(dev->size, dev->quantum);
+    unsigned long item = *qi / dev->qset;
+    scull_qset *qs;
+
+    while (*qi < last && (qs = xa_find(dev->qsets, &item, ULONG_MAX, XA_PRESENT))) {
+        if (item != *qi / dev->qset) *qi = item * dev->qset;
+        for (; qs->data && *qi < last && *qi / dev->qset == item; ++*qi) {
+            void *q = qs->data[*qi % dev->qset];
+            if (q) return q;
+        } // for
+        *qi = ++item * dev->qset;
+    } // while
+    return NULL;
+} // scull_image_next()
+
+
+// scull_image_extents
+// runs of populated quanta, counted only when ext is NULL
+static u64 scull_image_extents(scull_dev *dev, struct scull_image_extent *ext, u64 *nr_quanta)
+{
+    unsigned long qi = 0, end = ULONG_MAX;
+    u64 n = 0, nr = 0;
+
+    for (; scull_image_next(dev, &qi); qi++, nr++) {
+        if (qi != end) {
+            if (ext) ext[n] = (struct scull_image_extent){ .first = qi };
+            n++;
+        } // if
+        if (ext) ext[n - 1].count++;
+        end = qi + 1;
+    } // for
+    *nr_quanta = nr;
+    return n;
+} // scull_image_extents()
+
+
+// scull_image_save
+// header and extent map go out in one write padded to data_offset, the
+// payloads follow in SCULL_IMAGE_BATCH sized writes taken directly from the
+// quantum pages, compressed quanta are inflated into a bounce buffer
+// instead of in place so saving doesn't grow the device
+int scull_image_save(scull_dev *dev, struct file *file)
+{
+    struct scull_image_header hdr = {
+        .magic = SCULL_IMAGE_MAGIC,
+        .version = SCULL_IMAGE_VERSION,
+        .quantum = dev->quantum,
+        .qset = dev->qset,
+        .size = dev->size,
+    };
+    scull_image_io *io = kmalloc(sizeof(*io), GFP_KERNEL);
+    unsigned long qi = 0;
+    void *map = NULL, *buf = NULL, *q;
+    loff_t pos = 0;
+    ssize_t ret;
+    int err = -ENOMEM;
+
+    hdr.nr_extents = scull_image_extents(dev, NULL, &hdr.nr_quanta);
+    hdr.data_offset = PAGE_ALIGN(sizeof(hdr) + hdr.nr_extents * sizeof(struct scull_image_extent));
+    if (!io) goto out;
+    map = kvzalloc(hdr.data_offset, GFP_KERNEL | __GFP_NOWARN);
+    if (!map) goto out;
+    memcpy(map, &hdr, sizeof(hdr));
+    scull_image_extents(dev, map + sizeof(hdr), &hdr.nr_quanta);
+    ret = kernel_write(file, map, hdr.data_offset, &pos);
+    if (ret != hdr.data_offset) {
+        err = ret < 0 ? ret : -EIO;
+        goto out;
+    } // if
+
+    io->file = file;
+    io->pos = pos;
+    io->nr = 0;
+    for (err = 0; !err && (q = scull_image_next(dev, &qi)); qi++) {
+        if (!scull_is_zq(q)) {
+            err = scull_image_add(io, scull_dq_ptr(q), dev->quantum, true);
+            continue;
+        } // if
+        err = scull_image_flush(io, true);
+        if (!err && !buf && !(buf = kvmalloc(dev->quantum, GFP_KERNEL))) err = -ENOMEM;
+        if (!err) err = scull_zq_read(q, buf, dev->quantum);
+        if (err) break;
+        ret = kernel_write(file, buf, dev->quantum, &io->pos);
+        if (ret != dev->quantum) err = ret < 0 ? ret : -EIO;
+    } // for
+    if (!err) err = scull_image_flush(io, true);
+
+    out:
+        kvfree(buf);
+        kvfree(map);
+        kfree(io);
+        return err;
+} // scull_image_save()
+
+
+// scull_image_load
+// the header and extent map are checked in full before the device is
+// trimmed, then every quantum of the map is allocated and read into
+// directly, a load that fails part way leaves the device empty
+int scull_image_load(scull_dev *dev, struct file *file)
+{
+    struct scull_image_header hdr;
+    struct scull_image_extent *ext = NULL;
+    scull_file sf = { .dev = dev };
+    scull_image_io *io = NULL;
+    unsigned long last;
+    u64 next = 0, nr = 0;
+    loff_t pos = 0;
+    size_t map;
+    ssize_t ret;
+    int err;
+
+    ret = kernel_read(file, &hdr, sizeof(hdr), &pos);
+    if (ret < 0) return ret;
+    if (ret != sizeof(hdr) || hdr.magic != SCULL_IMAGE_MAGIC || hdr.version != SCULL_IMAGE_VERSION)
+        return -EINVAL;
+    err = scull_check_geometry(hdr.quantum, hdr.qset);
+    if (err) return err;
+    if (hdr.size > MAX_LFS_FILESIZE) return -EINVAL;
+    last = DIV_ROUND_UP(hdr.size, hdr.quantum);
+    map = hdr.nr_extents * sizeof(*ext);
+    if (hdr.nr_quanta > last || hdr.nr_extents > hdr.nr_quanta ||
+        hdr.data_offset < sizeof(hdr) + map || !PAGE_ALIGNED(hdr.data_offset))
+        return -EINVAL;
+
+    err = -ENOMEM;
+    ext = kvmalloc(map ? map : 1, GFP_KERNEL | __GFP_NOWARN);
+    io = kmalloc(sizeof(*io), GFP_KERNEL);
+    if (!ext || !io) goto out;
+    ret = kernel_read(file, ext, map, &pos);
+    err = ret < 0 ? ret : -EINVAL;
+    if (ret != map) goto out;
+    for (u64 i = 0; i < hdr.nr_extents; i++) {
+        if (!ext[i].count || ext[i].first < next || ext[i].first >= last ||
+            ext[i].count > last - ext[i].first)
+            goto out;
+        next = ext[i].first + ext[i].count;
+        nr += ext[i].count;
+    } // for
+    if (nr != hdr.nr_quanta) goto out;
+
+    scull_trim(dev);
+    scull_set_geometry(dev, hdr.quantum, hdr.qset);
+    io->file = file;
+    io->pos = hdr.data_offset;
+    io->nr = 0;
+    for (u64 i = 0; i < hdr.nr_extents; i++) {
+        for (u64 qi = ext[i].first; qi < ext[i].first + ext[i].count; qi++) {
+            scull_qset *qs;
+            void *q = scull_lock_quantum(&sf, (loff_t)qi * hdr.quantum, &qs);
+
+            if (!q) {
+                err = scull_over_limit(dev) ? -ENOSPC : -ENOMEM;
+                goto fail;
+            } // if
+            mutex_unlock(&qs->lock);
+            err = scull_image_add(io, q, hdr.quantum, false);
+            if (err) goto fail;
+        } // for
+        cond_resched();
+    } // for
+    err = scull_image_flush(io, false);
+    if (err) goto fail;
+    dev->size = hdr.size;
+    atomic_long_set(&dev->tail, hdr.size);
+    goto out;
+
+    fail:
+        scull_trim(dev);
+    out:
+        kfree(io);
+        kvfree(ext);
+        return err;
+} // scull_image_load()
+
+
+// scull_image_do_sync
+static int scull_image_do_sync(scull_dev *dev, const char *dir, unsigned int index, bool save)
+{
+    char *path = kasprintf(GFP_KERNEL, "%s/scull%u.img", dir, index);
+    int flags = save ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+    struct file *file;
+    int err;
+
+    if (!path) return -ENOMEM;
+    file = filp_open(path, flags | O_LARGEFILE, 0600);
+    if (IS_ERR(file)) {
+        err = PTR_ERR(file);
+        if (!save && err == -ENOENT) err = 0;
+    } else {
+        down_write(&dev->sem);
+        scull_stripes_lock(dev);
+        err = save ? scull_image_save(dev, file) : scull_image_load(dev, file);
+        scull_stripes_unlock(dev);
+        up_write(&dev->sem);
+        filp_close(file, NULL);
+    } // if
+    if (err) printk(KERN_WARNING "scull: %s %s failed (%d)\n", save ? "saving" : "loading", path, err);
+    kfree(path);
+    return err;
+} // scull_image_do_sync()
+
+
+// a sync handed to a worker, see scull_image_sync
+typedef struct scull_image_work {
+    struct work_struct work;
+    scull_dev *dev;
+    const char *dir;
+    unsigned int index;
+    bool save;
+    int err;
+} scull_image_work; // struct scull_image_work
+
+
+// scull_image_sync_work
+static void scull_image_sync_work(struct work_struct *work)
+{
+    scull_image_work *w = container_of(work, scull_image_work, work);
+
+    w->err = scull_image_do_sync(w->dev, w->dir, w->index, w->save);
+} // scull_image_sync_work()
+
+
+// scull_image_sync
+// the first open restores a device everyone shares, so the image path is
+// resolved and opened from a kworker, against init's root and mount
+// namespace with kernel credentials, never as whichever task got there first
+int scull_image_sync(scull_dev *dev, const char *dir, unsigned int index, bool save)
+{
+    scull_image_work w = { .dev = dev, .dir = dir, .index = index, .save = save };
+
+    INIT_WORK_ONSTACK(&w.work, scull_image_sync_work);
+    queue_work(system_unbound_wq, &w.work);
+    flush_work(&w.work);
+    destroy_work_on_stack(&w.work);
+    return w.err;
+} // scull_image_sync()
@@ -0,0 +1,22 @@
+#include <linux/types.h>
+#include <linux/fs.h>
+#include "util.h"
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+# define SCULL_IMAGE_BATCH 256 /* pages per read or write of payloads, 1 MiB */
+
+
+// stream a device to or from an image file, see struct scull_image_header
+// in scull_ioctl.h, loading replaces the device's contents
+// caller must hold dev->sem for writing
+int scull_image_save(struct scull_dev *, struct file *);
+int scull_image_load(struct scull_dev *, struct file *);
+
+// save or load <dir>/scull<index>.img around module unload and first open,
+// a missing image on load is not an error, the file is opened by a kworker
+// so the caller's root and credentials don't matter
+int scull_image_sync(struct scull_dev *, const char *, unsigned int, bool);
+
+# endif
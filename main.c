@@ -3,48 +3,159 @@
 #include <linux/fs.h>
 #include <linux/errno.h>
 #include <linux/slab.h>
-#include <linux/semaphore.h>
+#include <linux/rwsem.h>
 #include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/xarray.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/huge_mm.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/io_uring/cmd.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/file.h>
+#include <linux/sched/signal.h>
+#include <linux/wait_bit.h>
 #include "main.h"
 #include "util.h"
+#include "pipe.h"
+#include "compress.h"
+#include "dedup.h"
+#include "stats.h"
+#include "image.h"
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+#include "scull_ioctl.h"
 
 
 
 // global variables
 dev_t devno;
-scull_dev *scull_devices[NUM_DEVICES];
+struct class *scull_class;
+static struct cdev scull_cdev;            /* one cdev spans every scull minor */
+static DEFINE_XARRAY(scull_devices);      /* minor index -> scull_dev, filled on first open */
+
+// module parameters, the defaults every device starts with
+int scull_nr_devs = NUM_DEVICES;
+module_param(scull_nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(scull_nr_devs, "number of scull minors, devices are allocated on first open");
+int scull_quantum = SCULL_QUANTUM_SIZE;
+int scull_qset = SCULL_QSET_SIZE;
+bool scull_adaptive = false;
+module_param(scull_quantum, int, S_IRUGO);
+MODULE_PARM_DESC(scull_quantum, "quantum size in bytes, a power of two number of pages");
+module_param(scull_qset, int, S_IRUGO);
+MODULE_PARM_DESC(scull_qset, "quanta per qset");
+module_param(scull_adaptive, bool, S_IRUGO);
+MODULE_PARM_DESC(scull_adaptive, "grow the quantum when an empty device sees a large write");
+int scull_numa_policy = SCULL_NUMA_LOCAL;
+int scull_numa_node = NUMA_NO_NODE;
+module_param(scull_numa_policy, int, S_IRUGO);
+MODULE_PARM_DESC(scull_numa_policy, "quantum placement, 0 writer's node, 1 bind to scull_numa_node, 2 interleave");
+module_param(scull_numa_node, int, S_IRUGO);
+MODULE_PARM_DESC(scull_numa_node, "node used by scull_numa_policy=1");
+char *scull_compressor = "lz4";
+unsigned int scull_compress_ms = 0;
+module_param(scull_compressor, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_compressor, "crypto compression algorithm for cold quanta, e.g. lz4 or zstd");
+module_param(scull_compress_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(scull_compress_ms, "compress quanta idle for this many ms, 0 disables");
+bool scull_dedup = false;
+module_param(scull_dedup, bool, S_IRUGO);
+MODULE_PARM_DESC(scull_dedup, "share identical quanta within and across devices");
+unsigned long scull_limit = 0;
+bool scull_limit_block = false;
+module_param(scull_limit, ulong, S_IRUGO);
+MODULE_PARM_DESC(scull_limit, "per device byte quota, 0 for none");
+module_param(scull_limit_block, bool, S_IRUGO);
+MODULE_PARM_DESC(scull_limit_block, "writers over the quota sleep for room instead of failing with ENOSPC");
+char *scull_image_dir = NULL;
+module_param(scull_image_dir, charp, S_IRUGO);
+MODULE_PARM_DESC(scull_image_dir, "directory devices are saved to on unload and restored from on first open");
+unsigned int scull_stripes = 0;
+module_param(scull_stripes, uint, S_IRUGO);
+MODULE_PARM_DESC(scull_stripes, "lock stripes per device, e.g. the number of CPUs, rounded up to a power of two, 0 disables");
+static struct shrinker *scull_shrinker;
 
 // scull_init
 // register device numbers (using alloc_chrdev_region or register_chrdev_region)
 // initialize character devices (cdev structures and associate file operations)
-// create and initialize any necessary data structures or resources
 // register the device with cdev_add
-// create associated device nodes (using mknod, typically done by user-space scripts)
+// create a struct device per minor so udev makes the /dev nodes
+// the scull_dev behind each minor is only created on first open, so load
+// time and idle memory don't depend on how much state a device carries
 static int __init scull_init(void) {
     char *name = "scull";
-    int result = alloc_chrdev_region(&devno, BASE_MINOR, NUM_DEVICES, name);
+    int nr_minors = scull_nr_devs + SCULL_P_NR_DEVS;
+    int result = scull_check_geometry(scull_quantum, scull_qset);
+    if (result) return result;
+    result = scull_check_numa(scull_numa_policy, scull_numa_node);
+    if (result) return result;
+    if (scull_nr_devs < 1 || nr_minors > SCULL_MAX_MINORS) return -EINVAL;
+    result = scull_cache_init();
+    if (result) return result;
+    result = scull_dedup_init();
     if (result) {
-        printk(KERN_WARNING "scull: can't get major %d\n", devno);
+        scull_cache_exit();
         return result;
+    } // if
+    scull_compress_init(scull_compressor);
+    scull_debugfs_init();
+    result = alloc_chrdev_region(&devno, BASE_MINOR, nr_minors, name);
+    if (result) {
+        printk(KERN_WARNING "scull: can't get major %d\n", devno);
+        goto fail_region;
     }   
-    // init NUM_DEVICES of scull_fops starting at BASE_MINOR
-    for (size_t i = 0; i < NUM_DEVICES; ++i) {
-        // assign new char device to each kernal device
-        scull_devices[i] = kmalloc(sizeof(scull_dev), GFP_KERNEL);
-        if (!scull_devices[i]) goto fail;
-        scull_setup_cdev(scull_devices[i], (int)(i + BASE_MINOR));
+    scull_class = class_create(name);
+    if (IS_ERR(scull_class)) {
+        result = PTR_ERR(scull_class);
+        goto fail_class;
+    } // if
+    result = scull_setup_cdev();
+    if (result) goto fail_cdev;
+    for (int i = 0; i < scull_nr_devs; ++i) {
+        struct device *d = device_create(scull_class, NULL, MKDEV(MAJOR(devno), MINOR(devno) + i),
+                                         NULL, "scull%d", i);
+        if (IS_ERR(d)) {
+            result = PTR_ERR(d);
+            while (i--) device_destroy(scull_class, MKDEV(MAJOR(devno), MINOR(devno) + i));
+            goto fail_nodes;
+        } // if
     } // for
+    // scullpipe minors follow the scull minors
+    result = scull_p_init(MKDEV(MAJOR(devno), MINOR(devno) + scull_nr_devs), scull_class);
+    if (result) goto fail_pipe;
+    proc_create_single("scullmem", 0, NULL, scull_read_procmem);
+    // without a shrinker scull still works, it just can't give memory back
+    scull_shrinker = shrinker_alloc(0, "scull");
+    if (scull_shrinker) {
+        scull_shrinker->count_objects = scull_shrink_count;
+        scull_shrinker->scan_objects = scull_shrink_scan;
+        shrinker_register(scull_shrinker);
+    } // if
     printk(KERN_INFO "Successfully allocated device major/minor and matched device");
     return 0;
-    fail:
-        for (size_t i = 0; i < NUM_DEVICES; ++i) {
-            if (scull_devices[i]) {
-                cdev_del(&(scull_devices[i]->cdev));
-                kfree(scull_devices[i]);
-            } // if
-        } // for
-        unregister_chrdev_region(devno, NUM_DEVICES);
-        return -ENOMEM;
+
+    fail_pipe:
+        for (int i = 0; i < scull_nr_devs; ++i)
+            device_destroy(scull_class, MKDEV(MAJOR(devno), MINOR(devno) + i));
+    fail_nodes:
+        cdev_del(&scull_cdev);
+    fail_cdev:
+        class_destroy(scull_class);
+    fail_class:
+        unregister_chrdev_region(devno, nr_minors);
+    fail_region:
+        scull_debugfs_exit();
+        scull_dedup_exit();
+        scull_compress_exit();
+        scull_cache_exit();
+        return result;
 } // scull_init()
 
 
@@ -52,33 +163,218 @@ static int __init scull_init(void) {
 // unregister character devices (using cdev_del)
 // free allocated device numbers (using unregister_chrdev_region)
 // clean up and release any resources or data structures
-// remove associated device nodes, (typically done by user-space scripts))
+// device nodes go away with their struct devices
 static void __exit scull_exit(void) {
-    unregister_chrdev_region(devno, NUM_DEVICES);
-    // Free memory from device structs
-    for (size_t i = 0; i < NUM_DEVICES; ++i) {
-        if (scull_devices[i]) {
-            cdev_del(&(scull_devices[i]->cdev));
-            kfree(scull_devices[i]);
-        } // if 
-    } // for
+    scull_dev *dev;
+    unsigned long idx;
+
+    shrinker_free(scull_shrinker);
+    remove_proc_entry("scullmem", NULL);
+    scull_p_cleanup();
+    for (int i = 0; i < scull_nr_devs; ++i)
+        device_destroy(scull_class, MKDEV(MAJOR(devno), MINOR(devno) + i));
+    cdev_del(&scull_cdev);
+    class_destroy(scull_class);
+    unregister_chrdev_region(devno, scull_nr_devs + SCULL_P_NR_DEVS);
+    // Free memory from the devices that were ever opened
+    xa_for_each(&scull_devices, idx, dev) {
+        if (scull_image_dir) scull_image_sync(dev, scull_image_dir, idx, true);
+        scull_dev_destroy(dev);
+    } // xa_for_each
+    xa_destroy(&scull_devices);
+    scull_debugfs_exit();
+    scull_dedup_exit();
+    scull_compress_exit();
+    scull_cache_exit();
     printk(KERN_INFO "Successfully deallocated device major/minor and matched device");
     return;
 } // scull_exit()
 
 
+// scull_read_procmem
+// /proc/scullmem, one summary line per device that has been opened
+// devices live until module exit, so the walk needs no locking
+static int scull_read_procmem(struct seq_file *m, void *v) {
+    scull_dev *dev;
+    unsigned long idx;
+
+    xa_for_each(&scull_devices, idx, dev) {
+        scull_stats_summary(m, dev, idx);
+    } // xa_for_each
+    return 0;
+} // scull_read_procmem()
+
+
+// scull_shrink_count
+// objects are pages, pooled quanta can be dropped outright and cold
+// quanta can shrink by compression, see scull_compress_count; scull holds
+// the only copy of its data so nothing it stores is clean in the page
+// cache sense
+static unsigned long scull_shrink_count(struct shrinker *s, struct shrink_control *sc) {
+    unsigned long count = 0, idx;
+    scull_dev *dev;
+
+    xa_for_each(&scull_devices, idx, dev) {
+        unsigned long pages = READ_ONCE(dev->quantum) >> PAGE_SHIFT;
+        count += (scull_pool_count(dev) + scull_compress_count(dev)) * pages;
+    } // xa_for_each
+    return count ? count : SHRINK_EMPTY;
+} // scull_shrink_count()
+
+
+// scull_shrink_scan
+// free pooled quanta first, then compress quanta idle for a second
+// never sleeps on dev->sem, a busy device is skipped until the next call
+static unsigned long scull_shrink_scan(struct shrinker *s, struct shrink_control *sc) {
+    unsigned long freed = 0, idx;
+    scull_dev *dev;
+
+    xa_for_each(&scull_devices, idx, dev) {
+        long nr;
+        if (freed >= sc->nr_to_scan) break;
+        if (!down_write_trylock(&dev->sem)) continue;
+        if (!scull_stripes_trylock(dev)) {
+            up_write(&dev->sem);
+            continue;
+        } // if
+        nr = scull_pool_drain(dev);
+        atomic64_add((u64)nr * dev->quantum, &dev->reclaimed_bytes);
+        freed += nr * (dev->quantum >> PAGE_SHIFT);
+        scull_stripes_unlock(dev);
+        up_write(&dev->sem);
+    } // xa_for_each
+    xa_for_each(&scull_devices, idx, dev) {
+        unsigned long pages = READ_ONCE(dev->quantum) >> PAGE_SHIFT;
+        long saved;
+        if (freed >= sc->nr_to_scan) break;
+        /* the budget is in quanta, nr_to_scan in pages */
+        saved = scull_compress_reclaim(dev, DIV_ROUND_UP(sc->nr_to_scan - freed, pages));
+        atomic64_add(saved, &dev->reclaimed_bytes);
+        freed += saved >> PAGE_SHIFT;
+    } // xa_for_each
+    return freed ? freed : SHRINK_STOP;
+} // scull_shrink_scan()
+
+
+// scull_dev_destroy
+// trim and free a device, also used to unwind a half built one
+static void scull_dev_destroy(scull_dev *dev) {
+    scull_debugfs_remove(dev);
+    scull_set_compress(dev, 0);
+    cancel_work_sync(&dev->dq_work);
+    if (dev->qsets) {
+        scull_trim(dev);
+        scull_trim_flush();
+        xa_destroy(dev->qsets);
+        kfree(dev->qsets);
+    } // if
+    if (dev->pool) {
+        scull_pool_drain(dev);
+        free_percpu(dev->pool);
+    } // if
+    if (dev->mapped) iput(dev->mapped);
+    kfree(dev->node_quanta);
+    kfree(dev->stripes);
+    free_percpu(dev->stats);
+    kfree(dev);
+} // scull_dev_destroy()
+
+
+// scull_dev_create
+// a fresh empty device with the module parameter defaults
+static scull_dev *scull_dev_create(void) {
+    scull_dev *dev = kzalloc(sizeof(scull_dev), GFP_KERNEL);
+    if (!dev) return NULL;
+    dev->stats = alloc_percpu(scull_stats);
+    if (!dev->stats) {
+        kfree(dev);
+        return NULL;
+    } // if
+    init_rwsem(&dev->sem);
+    INIT_DELAYED_WORK(&dev->compress_work, scull_compress_work);
+    INIT_WORK(&dev->dq_work, scull_dq_retire_work);
+    init_llist_head(&dev->dq_retired);
+    init_waitqueue_head(&dev->space_wait);
+    spin_lock_init(&dev->append_lock);
+    INIT_LIST_HEAD(&dev->append_holes);
+    dev->limit = scull_limit;
+    dev->limit_block = scull_limit_block;
+    dev->dedup = scull_dedup;
+    dev->quantum = dev->def_quantum = scull_quantum;
+    dev->qset = dev->def_qset = scull_qset;
+    dev->adaptive = scull_adaptive;
+    scull_set_numa(dev, scull_numa_policy, scull_numa_node);
+    dev->node_quanta = kcalloc(nr_node_ids, sizeof(atomic_long_t), GFP_KERNEL);
+    dev->pool = alloc_percpu(scull_qpool);
+    dev->qsets = kmalloc(sizeof(struct xarray), GFP_KERNEL);
+    if (dev->qsets) xa_init(dev->qsets);
+    if (scull_stripes) {
+        dev->nr_stripes = roundup_pow_of_two(min_t(unsigned int, scull_stripes, SCULL_STRIPES_MAX));
+        dev->stripes = kcalloc(dev->nr_stripes, sizeof(scull_stripe), GFP_KERNEL);
+        for (unsigned int i = 0; dev->stripes && i < dev->nr_stripes; i++)
+            init_rwsem(&dev->stripes[i].sem);
+    } // if
+    if (!dev->node_quanta || !dev->pool || !dev->qsets || (dev->nr_stripes && !dev->stripes)) {
+        scull_dev_destroy(dev);
+        return NULL;
+    } // if
+    if (scull_compress_ms) scull_set_compress(dev, scull_compress_ms);
+    return dev;
+} // scull_dev_create()
+
+
+// scull_get_dev
+// look up the device behind a minor, creating it on first use
+// racing openers insert with xa_cmpxchg and the loser frees its copy
+static scull_dev *scull_get_dev(unsigned int index) {
+    scull_dev *dev = xa_load(&scull_devices, index);
+    scull_dev *old;
+
+    if (dev) return dev;
+    dev = scull_dev_create();
+    if (!dev) return ERR_PTR(-ENOMEM);
+    dev->minor = MINOR(devno) + index;
+    // restored before the device is published, a losing racer's copy is wasted
+    if (scull_image_dir) scull_image_sync(dev, scull_image_dir, index, false);
+    old = xa_cmpxchg(&scull_devices, index, NULL, dev, GFP_KERNEL);
+    if (old) {
+        scull_dev_destroy(dev);
+        if (xa_is_err(old)) return ERR_PTR(xa_err(old));
+        return old;
+    } // if
+    scull_debugfs_add(dev, index);
+    return dev;
+} // scull_get_dev()
+
+
 // scull_open
 // check for device specific errors with inode
 // initialize device if opened for the first time
 // update the f_op pointer if nessessary (in filp)
 // allocate any data needed for othe filp->private_data
 int scull_open(struct inode *inode, struct file *filp) {
-    scull_dev *dev = container_of(inode->i_cdev, scull_dev, cdev);
-    filp->private_data = dev;
+    scull_dev *dev = scull_get_dev(iminor(inode) - MINOR(devno));
+    scull_file *sf;
+    bool trim = (filp->f_flags & O_ACCMODE) == O_WRONLY;
+    u64 wait;
+    if (IS_ERR(dev)) return PTR_ERR(dev);
+    sf = kzalloc(sizeof(scull_file), GFP_KERNEL);
+    if (!sf) return -ENOMEM;
+    sf->dev = dev;
+    filp->private_data = sf;
     // clear the device if write only flag set
-    if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
+    if (trim) {
+        if (scull_lock_write(dev, &wait)) {
+            kfree(sf);
+            return -ERESTARTSYS;
+        } // if
+        /* mappings would otherwise keep using pages that left the device */
+        unmap_mapping_range(filp->f_mapping, 0, 0, 1);
         scull_trim(dev);
+        scull_stripes_unlock(dev);
+        up_write(&dev->sem);
     } // if
+    trace_scull_open(dev->minor, filp->f_flags, trim);
     return 0;
 } // scull_open()
 
@@ -88,53 +384,981 @@ int scull_open(struct inode *inode, struct file *filp) {
 // note that filp->private_data is emptied by OS
 // note release is only invoked on the final close
 int scull_release(struct inode *inode, struct file *filp) {
+    scull_file *sf = filp->private_data;
+
+    trace_scull_release(sf->dev->minor);
+    kfree(sf);
     return 0;
 } // scull_release()
 
 
 // scull_setup_cdev
 // to be called by the init funciton
-// set up a scull device struct for each of the 4 devices
-// mknod creates the device
+// a single cdev covers all scull_nr_devs minors, open maps the minor
+// to its scull_dev
 // mkdev is kernal space macro to extract major and minor device number
 // cdev_add is a kernal space function to register the device to the driver
 // additionally, the function should be called at the very end of module init
-void scull_setup_cdev(scull_dev *dev, int index) {
-    dev_t devno_sp = MKDEV(MAJOR(devno), index + BASE_MINOR);
-    // formal way of dev->cdev.ops = &scull_fops
-    cdev_init(&(dev->cdev), &scull_fops);
+int scull_setup_cdev(void) {
+    // formal way of scull_cdev.ops = &scull_fops
+    cdev_init(&scull_cdev, &scull_fops);
     // good practice to also set the owner here
-    dev->cdev.owner = THIS_MODULE; 
+    scull_cdev.owner = THIS_MODULE; 
 
-    int err = cdev_add(&(dev->cdev), devno_sp, 1);
+    int err = cdev_add(&scull_cdev, devno, scull_nr_devs);
     if (err) {
-        printk(KERN_NOTICE "Error %d adding scull%d", err, index);
+        printk(KERN_NOTICE "Error %d adding scull devices", err);
     } // err
-} // scull_detup_cdev()
+    return err;
+} // scull_setup_cdev()
+
+
+// scull_do_read
+// copy up to iov_iter_count bytes starting at pos, crossing quanta and
+// iovec segments in one pass
+// quanta that were never written inside the device size read back as zeros
+// the copy runs with page faults disabled and stops short on a user page
+// that isn't mapped, see scull_do_io
+// caller must hold dev->sem for reading
+static ssize_t scull_do_read(scull_file *sf, loff_t pos, struct iov_iter *to) {
+    scull_dev *dev = sf->dev;
+    size_t count = iov_iter_count(to);
+    unsigned long size = READ_ONCE(dev->size);
+    ssize_t retval = 0;
+
+    if (pos < 0) return -EINVAL;
+    if (pos >= size) return 0;
+    if (pos + count > size) count = size - pos;
+
+    while (count) {
+        long q_pos = (long)pos % dev->quantum;
+        size_t chunk = min_t(size_t, count, dev->quantum - q_pos);
+        char *q = scull_get_quantum(sf, pos);
+        size_t copied;
+
+        if (IS_ERR(q)) return retval ? retval : PTR_ERR(q);
+        pagefault_disable();
+        copied = q ? copy_to_iter(q + q_pos, chunk, to) : iov_iter_zero(chunk, to);
+        pagefault_enable();
+        pos += copied;
+        retval += copied;
+        count -= copied;
+        if (copied < chunk) return retval ? retval : -EFAULT;
+    } // while
+    return retval;
+} // scull_do_read()
+
+
+// scull_do_write
+// copy the iov_iter into the quantum store at pos, allocating qsets and
+// quanta on demand, writers serialize per qset rather than per device
+// a short count is returned if allocation or the user copy fails part way,
+// the copy runs with page faults disabled like scull_do_read's
+// caller must hold dev->sem for reading
+static ssize_t scull_do_write(scull_file *sf, loff_t pos, struct iov_iter *from) {
+    scull_dev *dev = sf->dev;
+    ssize_t retval = 0;
+
+    if (pos < 0) return -EINVAL;
+    while (iov_iter_count(from)) {
+        long q_pos = (long)pos % dev->quantum;
+        size_t chunk = min_t(size_t, iov_iter_count(from), dev->quantum - q_pos);
+        scull_qset *qs;
+        char *q = scull_lock_quantum(sf, pos, &qs);
+        size_t copied;
+
+        if (!q) return retval ? retval : scull_over_limit(dev) ? -ENOSPC : -ENOMEM;
+        pagefault_disable();
+        copied = copy_from_iter(q + q_pos, chunk, from);
+        pagefault_enable();
+        if (q_pos + copied == dev->quantum && READ_ONCE(dev->dedup))
+            scull_dq_share(dev, qs, (pos / dev->quantum) % dev->qset);
+        mutex_unlock(&qs->lock);
+        pos += copied;
+        retval += copied;
+        scull_extend_size(dev, pos);
+        if (copied < chunk) return retval ? retval : -EFAULT;
+    } // while
+    return retval;
+} // scull_do_write()
+
+
+// scull_do_append
+// O_APPEND writes reserve their range with a cmpxchg on dev->tail and copy
+// into it in parallel, each under its qset lock, dev->size is the commit
+// watermark and only moves past a record once every record reserved before
+// it has committed, so readers never see a partly copied record
+// a reservation that would pass MAX_LFS_FILESIZE is refused and leaves
+// tail alone, a record that fails part way still commits its whole range,
+// whatever wasn't copied reads back as zeros, and appended quanta are not
+// offered to dedup since other appenders may still be copying into them
+// an appender killed while waiting for its turn abandons its range to the
+// commit that reaches it
+// from must not fault, scull_write_iter bounces user buffers first
+// *pos is set to where the record went
+// caller must hold dev->sem for reading
+static ssize_t scull_do_append(scull_file *sf, loff_t *pos, struct iov_iter *from) {
+    scull_dev *dev = sf->dev;
+    size_t len = iov_iter_count(from);
+    long start, end, p;
+    ssize_t retval = 0;
+    int err = 0;
+
+    if (!len) return 0;
+    if (scull_over_limit(dev)) return -ENOSPC;
+    start = atomic_long_read(&dev->tail);
+    do {
+        if (check_add_overflow(start, (long)len, &end) || end > MAX_LFS_FILESIZE)
+            return -EFBIG;
+    } while (!atomic_long_try_cmpxchg(&dev->tail, &start, end));
+    *pos = start;
+
+    for (p = start; p < end && !err; ) {
+        long q_pos = p % dev->quantum;
+        size_t chunk = min_t(size_t, end - p, dev->quantum - q_pos);
+        scull_qset *qs;
+        char *q = scull_lock_quantum(sf, p, &qs);
+        size_t copied;
+
+        if (!q) {
+            err = scull_over_limit(dev) ? -ENOSPC : -ENOMEM;
+            break;
+        } // if
+        copied = copy_from_iter(q + q_pos, chunk, from);
+        mutex_unlock(&qs->lock);
+        p += copied;
+        retval += copied;
+        if (copied < chunk) err = -EFAULT;
+    } // for
+
+    /* commit in reservation order, predecessors hold dev->sem too so they finish */
+    if (wait_var_event_killable(&dev->size, READ_ONCE(dev->size) >= start)) {
+        scull_append_abandon(dev, start, end);
+        return retval ? retval : -EINTR;
+    } // if
+    scull_extend_size(dev, end);
+    wake_up_var(&dev->size);
+    return retval ? retval : err;
+} // scull_do_append()
+
+
+// scull_adapt_quantum
+// in adaptive mode the first large write into an empty device picks a
+// bigger quantum, streaming writers then allocate one quantum per 64 KiB or
+// 2 MiB instead of per page while small record writers keep the default
+// called and returns with dev->sem held for reading
+static void scull_adapt_quantum(scull_dev *dev, size_t count) {
+    int quantum = count >= SCULL_ADAPT_LARGE ? SCULL_ADAPT_LARGE : SCULL_ADAPT_SMALL;
+
+    if (!READ_ONCE(dev->adaptive) || count < SCULL_ADAPT_SMALL) return;
+    if (!xa_empty(dev->qsets) || dev->quantum >= quantum) return;
+    up_read(&dev->sem);
+    down_write(&dev->sem);
+    scull_stripes_lock(dev);
+    if (xa_empty(dev->qsets) && dev->quantum < quantum)
+        scull_set_geometry(dev, quantum, dev->qset);
+    scull_stripes_unlock(dev);
+    downgrade_write(&dev->sem);
+} // scull_adapt_quantum()
+
+
+// scull_io_lock
+// shared lock for I/O on [pos, pos + len), the stripe's sem when a striped
+// device has the range inside one qset, dev->sem otherwise
+// returns the semaphore to up_read, or an ERR_PTR
+static struct rw_semaphore *scull_io_lock(scull_dev *dev, loff_t pos, size_t len, bool nowait,
+                                          u64 *wait) {
+    for (;;) {
+        long stripe = scull_stripe_of(dev, pos, len);
+        struct rw_semaphore *sem = stripe < 0 ? &dev->sem : &dev->stripes[stripe].sem;
+
+        if (nowait) {
+            if (!down_read_trylock(sem)) return ERR_PTR(-EAGAIN);
+        } else if (scull_lock_read(dev, sem, wait)) {
+            return ERR_PTR(-ERESTARTSYS);
+        } // if
+        /* the geometry can't change under a stripe, so this answer holds */
+        if (stripe < 0 || stripe == scull_stripe_of(dev, pos, len)) return sem;
+        up_read(sem);
+    } // for
+} // scull_io_lock()
+
+
+// scull_fault_in
+// fault in the user pages behind the next bytes of iter, only ever called
+// with no lock held, a read only does this after a copy came up short since
+// faulting a page in for writing stores to it
+// returns false if not even the first page could be faulted in
+static bool scull_fault_in(struct iov_iter *iter, bool write) {
+    size_t len = min_t(size_t, iov_iter_count(iter), SCULL_FAULT_IN);
+
+    if (!len) return true;
+    if (write) return fault_in_iov_iter_readable(iter, len) < len;
+    return fault_in_iov_iter_writeable(iter, len) < len;
+} // scull_fault_in()
+
+
+// scull_do_io
+// one read or write under the shared lock for its range
+// the user buffer may be a mapping of this device whose fault handler takes
+// dev->sem and the qset lock, and a stripe held across that is an ABBA
+// against scull_lock_write, so the copies run with page faults disabled
+// and a copy that stops short drops the lock, faults the pages in and
+// carries on from where it stopped, the way generic_perform_write does
+// a short read is usually the end of the device and the retry says so
+static ssize_t scull_do_io(scull_file *sf, loff_t pos, struct iov_iter *iter, bool write,
+                           bool nowait, u64 *wait) {
+    scull_dev *dev = sf->dev;
+    ssize_t retval = 0, ret;
+
+    *wait = 0;
+    if (write && !nowait && !scull_fault_in(iter, true)) return -EFAULT;
+    for (;;) {
+        struct rw_semaphore *sem;
+        u64 w = 0;
+
+        sem = scull_io_lock(dev, pos, iov_iter_count(iter), nowait, &w);
+        *wait += w;
+        if (IS_ERR(sem)) {
+            ret = PTR_ERR(sem);
+            break;
+        } // if
+        if (write && !retval && sem == &dev->sem && !nowait)
+            scull_adapt_quantum(dev, iov_iter_count(iter));
+        ret = write ? scull_do_write(sf, pos, iter) : scull_do_read(sf, pos, iter);
+        up_read(sem);
+        if (ret > 0) {
+            pos += ret;
+            retval += ret;
+            if (!iov_iter_count(iter)) break;
+            if (!write) continue;
+        } else if (ret != -EFAULT) {
+            break;
+        } // if
+        if (nowait) {
+            ret = -EAGAIN;
+            break;
+        } // if
+        if (fatal_signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        } // if
+        if (!scull_fault_in(iter, write)) {
+            ret = -EFAULT;
+            break;
+        } // if
+    } // for
+    return retval ? retval : ret;
+} // scull_do_io()
 
 
-// scull_read
-// use kmalloc and kfree from slab.h
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
-    // TODO
-    char *funny_thing_to_print = "Something funny haha\n";
-    size_t len = strlen(funny_thing_to_print) + 1;
-    if (copy_to_user(buf, funny_thing_to_print, len)) {
-        return -EFAULT;
+// scull_read_iter
+// read()/readv()/pread() all land here
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    scull_file *sf = iocb->ki_filp->private_data;
+    scull_dev *dev = sf->dev;
+    u64 start = ktime_get_ns(), wait = 0;
+    size_t len = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    ssize_t retval;
+
+    retval = scull_do_io(sf, pos, to, false, iocb->ki_flags & IOCB_NOWAIT, &wait);
+    if (retval > 0) iocb->ki_pos += retval;
+    scull_stat_inc(dev, reads);
+    if (retval > 0) scull_stat_add(dev, read_bytes, retval);
+    scull_stat_latency(dev, SCULL_LAT_READ, start);
+    if (trace_scull_read_enabled())
+        trace_scull_read(dev->minor, pos, len, retval, READ_ONCE(dev->quantum), wait,
+                         ktime_get_ns() - start);
+    return retval;
+} // scull_read_iter()
+
+
+// scull_write_iter
+// write()/writev()/pwrite() all land here
+// writers share dev->sem with readers, only trim takes it exclusively
+// O_APPEND writers reserve their range instead, see scull_do_append, and
+// copy a user buffer into a bounce buffer first since a reserved range
+// can't be dropped to fault pages in, which caps a record at
+// SCULL_APPEND_MAX
+// a writer that makes no progress against a blocking quota sleeps with
+// dev->sem dropped until a trim or quota change makes room
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    scull_file *sf = iocb->ki_filp->private_data;
+    scull_dev *dev = sf->dev;
+    u64 start = ktime_get_ns(), wait = 0;
+    size_t len = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    struct rw_semaphore *sem;
+    struct iov_iter bounced;
+    struct kvec kv;
+    void *bounce = NULL;
+    ssize_t retval;
+
+    if ((iocb->ki_flags & IOCB_APPEND) && len > SCULL_APPEND_MAX) return -EINVAL;
+    if ((iocb->ki_flags & IOCB_APPEND) && len && user_backed_iter(from)) {
+        bounce = kvmalloc(len, GFP_KERNEL_ACCOUNT | __GFP_NOWARN);
+        if (!bounce) return -ENOMEM;
+        kv.iov_base = bounce;
+        kv.iov_len = copy_from_iter(bounce, len, from);
+        if (!kv.iov_len) {
+            kvfree(bounce);
+            return -EFAULT;
+        } // if
+        iov_iter_kvec(&bounced, ITER_SOURCE, &kv, 1, kv.iov_len);
+        from = &bounced;
     } // if
-    return len;
-} // scull_read()
+    for (;;) {
+        if (iocb->ki_flags & IOCB_APPEND) {
+            /* an append doesn't know its range yet and goes through dev->sem */
+            sem = scull_io_lock(dev, pos, 0, iocb->ki_flags & IOCB_NOWAIT, &wait);
+            if (IS_ERR(sem)) {
+                retval = PTR_ERR(sem);
+                break;
+            } // if
+            if (!(iocb->ki_flags & IOCB_NOWAIT)) scull_adapt_quantum(dev, len);
+            pos = -1; /* until a range is reserved, after that no retry */
+            retval = scull_do_append(sf, &pos, from);
+            up_read(sem);
+        } else {
+            retval = scull_do_io(sf, pos, from, true, iocb->ki_flags & IOCB_NOWAIT, &wait);
+        } // if
+        /* an append that got a range has committed it and can't be retried */
+        if (retval != -ENOSPC || !READ_ONCE(dev->limit_block) ||
+            ((iocb->ki_flags & IOCB_APPEND) && pos >= 0))
+            break;
+        if (iocb->ki_flags & IOCB_NOWAIT) {
+            retval = -EAGAIN;
+            break;
+        } // if
+        if (wait_event_interruptible(dev->space_wait, !scull_over_limit(dev))) {
+            retval = -ERESTARTSYS;
+            break;
+        } // if
+    } // for
+    kvfree(bounce);
+    if (retval > 0) iocb->ki_pos = pos + retval;
+    scull_stat_inc(dev, writes);
+    if (retval > 0) scull_stat_add(dev, write_bytes, retval);
+    scull_stat_latency(dev, SCULL_LAT_WRITE, start);
+    if (trace_scull_write_enabled())
+        trace_scull_write(dev->minor, pos, len, retval, READ_ONCE(dev->quantum), wait,
+                          ktime_get_ns() - start);
+    return retval;
+} // scull_write_iter()
+
 
+// scull_check_range
+// ranges from the record ioctls and io_uring never pass rw_verify_area, so
+// they are bounded here the way scull_ioctl_fallocate bounds its own
+static int scull_check_range(u64 offset, u64 len) {
+    loff_t end;
 
-// scull_write
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
-    // TODO
+    if ((s64)offset < 0 || (s64)len < 0) return -EINVAL;
+    if (check_add_overflow((loff_t)offset, (loff_t)len, &end) || end > MAX_LFS_FILESIZE)
+        return -EFBIG;
     return 0;
-} // scull_write()
+} // scull_check_range()
+
+
+// scull_rec_io
+// the part of one record past its first skip bytes, under dev->sem held by
+// the caller when wait is NULL, through scull_do_io otherwise
+static s64 scull_rec_io(scull_file *sf, bool write, struct scull_rec *rec, u64 skip, u64 *wait) {
+    loff_t pos = rec->offset + skip;
+    struct iov_iter iter;
+    int err = scull_check_range(rec->offset, rec->len);
+
+    if (!err)
+        err = import_ubuf(write ? ITER_SOURCE : ITER_DEST, u64_to_user_ptr(rec->buf + skip),
+                          rec->len - skip, &iter);
+    if (err) return err;
+    if (wait) return scull_do_io(sf, pos, &iter, write, false, wait);
+    return write ? scull_do_write(sf, pos, &iter) : scull_do_read(sf, pos, &iter);
+} // scull_rec_io()
+
+
+// scull_ioctl_recs
+// apply a user array of record descriptors, one dev->sem acquisition per
+// SCULL_REC_CHUNK sized batch of descriptors, which are copied in and out
+// with the lock dropped, each entry's result is written back as a byte
+// count or -errno
+// a record whose copy stopped short on an unmapped page of its buffer is
+// finished after the batch through scull_do_io, which faults it in
+// returns the number of records processed
+static long scull_ioctl_recs(scull_file *sf, bool write, struct scull_rec_batch __user *ubatch) {
+    scull_dev *dev = sf->dev;
+    struct scull_rec_batch batch;
+    struct scull_rec *recs;
+    struct scull_rec __user *urecs;
+    long done = 0;
+    u64 wait;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch))) return -EFAULT;
+    if (batch.flags || batch.count > SCULL_REC_MAX) return -EINVAL;
+    urecs = u64_to_user_ptr(batch.recs);
+    recs = kmalloc_array(SCULL_REC_CHUNK, sizeof(*recs), GFP_KERNEL);
+    if (!recs) return -ENOMEM;
+
+    while (done < batch.count) {
+        long n = min_t(long, batch.count - done, SCULL_REC_CHUNK);
+        if (copy_from_user(recs, urecs + done, n * sizeof(*recs))) {
+            if (!done) done = -EFAULT;
+            break;
+        } // if
+        if (down_read_interruptible(&dev->sem)) {
+            if (!done) done = -ERESTARTSYS;
+            break;
+        } // if
+        for (long i = 0; i < n; i++)
+            recs[i].result = scull_rec_io(sf, write, &recs[i], 0, NULL);
+        up_read(&dev->sem);
+        for (long i = 0; i < n; i++) {
+            s64 res = recs[i].result, more;
+            u64 skip = res > 0 ? res : 0;
+
+            if (skip == recs[i].len || (res < 0 && res != -EFAULT)) continue;
+            more = scull_rec_io(sf, write, &recs[i], skip, &wait);
+            recs[i].result = more > 0 ? skip + more : res > 0 ? res : more;
+        } // for
+        if (copy_to_user(urecs + done, recs, n * sizeof(*recs))) {
+            if (!done) done = -EFAULT;
+            break;
+        } // if
+        done += n;
+    } // while
+    kfree(recs);
+    return done;
+} // scull_ioctl_recs()
+
+
+// scull_uring_cmd
+// io_uring passthrough for the same operations as read/write/trim and the
+// record ioctls
+// reads and writes run inline when dev->sem is free, anything that would
+// block on the lock, plus trims and batches, returns -EAGAIN on the
+// nonblocking issue so io_uring retries it from an io-wq worker and posts
+// the completion from there instead of stalling the submitter
+int scull_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    struct file *filp = ioucmd->file;
+    scull_file *sf = filp->private_data;
+    scull_dev *dev = sf->dev;
+    const struct scull_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+    bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+    bool write = false;
+    struct iov_iter iter;
+    ssize_t ret;
+    u64 wait;
+
+    if (!(issue_flags & IO_URING_F_SQE128)) return -EINVAL;
+    if (READ_ONCE(cmd->flags)) return -EINVAL;
+
+    switch (ioucmd->cmd_op) {
+        case SCULL_URING_WRITE:
+            write = true;
+            fallthrough;
+        case SCULL_URING_READ: {
+            /* the sqe is shared with user space, each field is read once */
+            u64 offset = READ_ONCE(cmd->offset), len = READ_ONCE(cmd->len);
+
+            if (!(filp->f_mode & (write ? FMODE_WRITE : FMODE_READ))) return -EBADF;
+            ret = scull_check_range(offset, len);
+            if (ret) return ret;
+            ret = import_ubuf(write ? ITER_SOURCE : ITER_DEST,
+                              u64_to_user_ptr(READ_ONCE(cmd->addr)), len, &iter);
+            if (ret) return ret;
+            ret = scull_do_io(sf, offset, &iter, write, nonblock, &wait);
+            return ret == -ERESTARTSYS ? -EINTR : ret;
+        }
+        case SCULL_URING_TRIM:
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            if (nonblock) return -EAGAIN;
+            if (down_write_killable(&dev->sem)) return -EINTR;
+            scull_stripes_lock(dev);
+            unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+            scull_trim(dev);
+            scull_stripes_unlock(dev);
+            up_write(&dev->sem);
+            return 0;
+        case SCULL_URING_WRITE_RECS:
+            write = true;
+            fallthrough;
+        case SCULL_URING_READ_RECS:
+            if (!(filp->f_mode & (write ? FMODE_WRITE : FMODE_READ))) return -EBADF;
+            if (nonblock) return -EAGAIN;
+            return scull_ioctl_recs(sf, write, u64_to_user_ptr(READ_ONCE(cmd->addr)));
+        default:
+            return -ENOTTY;
+    } // switch
+} // scull_uring_cmd()
+
+
+// scull_ioctl_geometry
+// set the device's default quantum or qset size, applied at once if the
+// device is empty and otherwise at the next trim
+static long scull_ioctl_geometry(scull_dev *dev, unsigned int cmd, u32 val) {
+    long quantum = dev->def_quantum, qset = dev->def_qset;
+
+    if (cmd == SCULL_IOC_SET_QUANTUM) quantum = val;
+    else qset = val;
+    if (scull_check_geometry(quantum, qset)) return -EINVAL;
+    if (down_write_killable(&dev->sem)) return -ERESTARTSYS;
+    scull_stripes_lock(dev);
+    dev->def_quantum = quantum;
+    dev->def_qset = qset;
+    if (xa_empty(dev->qsets)) scull_set_geometry(dev, quantum, qset);
+    scull_stripes_unlock(dev);
+    up_write(&dev->sem);
+    return 0;
+} // scull_ioctl_geometry()
+
+
+// scull_ioctl_snapshot
+// make the scull device behind fd, which the caller must have open for
+// writing, a copy on write snapshot of this device
+// both semaphores are taken in address order so two opposite snapshots
+// can't deadlock, the source's mappings are zapped so writes through them
+// fault again and copy instead of changing what the snapshot sees, and the
+// destination's so they don't keep the quanta its trim frees
+static long scull_ioctl_snapshot(struct file *filp, scull_dev *src, int fd) {
+    CLASS(fd, f)(fd);
+    scull_dev *dst, *first, *second;
+    long retval;
+
+    if (fd_empty(f)) return -EBADF;
+    if (fd_file(f)->f_op != &scull_fops) return -EINVAL;
+    if (!(fd_file(f)->f_mode & FMODE_WRITE)) return -EBADF;
+    dst = ((scull_file *)fd_file(f)->private_data)->dev;
+    if (dst == src) return -EINVAL;
+    first = src < dst ? src : dst;
+    second = src < dst ? dst : src;
+
+    if (down_write_killable(&first->sem)) return -ERESTARTSYS;
+    scull_stripes_lock(first);
+    down_write_nested(&second->sem, SINGLE_DEPTH_NESTING);
+    scull_stripes_lock(second);
+    unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+    unmap_mapping_range(fd_file(f)->f_mapping, 0, 0, 1);
+    retval = scull_snapshot(src, dst);
+    scull_stripes_unlock(second);
+    up_write(&second->sem);
+    scull_stripes_unlock(first);
+    up_write(&first->sem);
+    return retval;
+} // scull_ioctl_snapshot()
+
+
+// scull_ioctl_image
+// save this device to, or replace its contents with, the image behind fd
+// a load zaps mappings of the old contents like a snapshot does, and a scull
+// device can't hold an image since its own I/O would need dev->sem
+static long scull_ioctl_image(struct file *filp, scull_dev *dev, bool save, int fd) {
+    CLASS(fd, f)(fd);
+    long retval;
+
+    if (fd_empty(f)) return -EBADF;
+    if (fd_file(f)->f_op == &scull_fops) return -EINVAL;
+    if (down_write_killable(&dev->sem)) return -ERESTARTSYS;
+    scull_stripes_lock(dev);
+    if (!save) unmap_mapping_range(filp->f_mapping, 0, 0, 1);
+    retval = save ? scull_image_save(dev, fd_file(f)) : scull_image_load(dev, fd_file(f));
+    scull_stripes_unlock(dev);
+    up_write(&dev->sem);
+    return retval;
+} // scull_ioctl_image()
+
+
+// scull_ioctl_fallocate
+// fallocate(2) refuses character devices before reaching the driver, so
+// preallocation and punch hole come in through here instead
+// punching takes dev->sem for writing since lockless readers may hold the
+// quanta it frees, and zaps the mappings over the hole first
+static long scull_ioctl_fallocate(struct file *filp, scull_dev *dev, struct scull_falloc __user *uarg) {
+    scull_file *sf = filp->private_data;
+    struct scull_falloc fa;
+    loff_t end;
+    long retval;
+
+    if (copy_from_user(&fa, uarg, sizeof(fa))) return -EFAULT;
+    if (fa.mode & ~(SCULL_FALLOC_KEEP_SIZE | SCULL_FALLOC_PUNCH_HOLE)) return -EOPNOTSUPP;
+    if ((s64)fa.offset < 0 || (s64)fa.len <= 0) return -EINVAL;
+    if (check_add_overflow((loff_t)fa.offset, (loff_t)fa.len, &end) || end > MAX_LFS_FILESIZE)
+        return -EFBIG;
+    if (fa.mode & SCULL_FALLOC_PUNCH_HOLE) {
+        if (down_write_killable(&dev->sem)) return -ERESTARTSYS;
+        scull_stripes_lock(dev);
+        unmap_mapping_range(filp->f_mapping, fa.offset, fa.len, 1);
+        retval = scull_punch_hole(sf, fa.offset, end);
+        scull_stripes_unlock(dev);
+        up_write(&dev->sem);
+        return retval;
+    } // if
+    if (down_read_interruptible(&dev->sem)) return -ERESTARTSYS;
+    retval = scull_prealloc(sf, fa.offset, end);
+    if (!retval && !(fa.mode & SCULL_FALLOC_KEEP_SIZE)) scull_extend_size(dev, end);
+    up_read(&dev->sem);
+    return retval;
+} // scull_ioctl_fallocate()
+
+
+// scull_ioctl_numa_usage
+// report the bytes each node holds for this device
+static long scull_ioctl_numa_usage(scull_dev *dev, struct scull_numa_usage __user *uarg) {
+    struct scull_numa_usage req;
+    u64 __user *usage;
+
+    if (copy_from_user(&req, uarg, sizeof(req))) return -EFAULT;
+    usage = u64_to_user_ptr(req.usage);
+    for (int node = 0; node < min_t(int, req.nr_nodes, nr_node_ids); node++) {
+        u64 bytes = (u64)atomic_long_read(&dev->node_quanta[node]) * READ_ONCE(dev->quantum);
+        if (put_user(bytes, usage + node)) return -EFAULT;
+    } // for
+    return put_user((u32)nr_node_ids, &uarg->nr_nodes);
+} // scull_ioctl_numa_usage()
+
+
+// scull_ioctl
+// replaces the pre 2.6.36 .ioctl, no big kernel lock is held here
+long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    scull_file *sf = filp->private_data;
+    scull_dev *dev = sf->dev;
+    void __user *uarg = (void __user *)arg;
+    u32 val;
+
+    switch (cmd) {
+        case SCULL_IOC_SET_QUANTUM:
+        case SCULL_IOC_SET_QSET:
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            if (get_user(val, (u32 __user *)uarg)) return -EFAULT;
+            return scull_ioctl_geometry(dev, cmd, val);
+        case SCULL_IOC_SET_ADAPTIVE:
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            if (get_user(val, (u32 __user *)uarg)) return -EFAULT;
+            WRITE_ONCE(dev->adaptive, !!val);
+            return 0;
+        case SCULL_IOC_GET_QUANTUM:
+            return put_user((u32)READ_ONCE(dev->quantum), (u32 __user *)uarg);
+        case SCULL_IOC_GET_QSET:
+            return put_user((u32)READ_ONCE(dev->qset), (u32 __user *)uarg);
+        case SCULL_IOC_SET_NUMA: {
+            struct scull_numa numa;
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            if (copy_from_user(&numa, uarg, sizeof(numa))) return -EFAULT;
+            return scull_set_numa(dev, numa.policy, numa.node);
+        }
+        case SCULL_IOC_GET_NUMA: {
+            struct scull_numa numa = {
+                .policy = READ_ONCE(dev->numa_policy),
+                .node = READ_ONCE(dev->numa_node),
+            };
+            return copy_to_user(uarg, &numa, sizeof(numa)) ? -EFAULT : 0;
+        }
+        case SCULL_IOC_GET_NUMA_USAGE:
+            return scull_ioctl_numa_usage(dev, uarg);
+        case SCULL_IOC_GET_TRIM_STATS: {
+            struct scull_trim_stats ts = {
+                .queued = atomic64_read(&dev->trims_queued),
+                .done = atomic64_read(&dev->trims_done),
+                .pending = atomic_long_read(&dev->trim_pending),
+                .freed_bytes = atomic64_read(&dev->trim_freed_bytes),
+            };
+            return copy_to_user(uarg, &ts, sizeof(ts)) ? -EFAULT : 0;
+        }
+        case SCULL_IOC_SET_COMPRESS:
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            if (get_user(val, (u32 __user *)uarg)) return -EFAULT;
+            return scull_set_compress(dev, val);
+        case SCULL_IOC_GET_COMPRESS_STATS: {
+            struct scull_compress_stats cs = {
+                .interval_ms = READ_ONCE(dev->compress_ms),
+                .nr_compressed = atomic64_read(&dev->zq_count),
+                .stored_bytes = atomic64_read(&dev->zq_stored),
+                .compress_ops = atomic64_read(&dev->zq_compress_ops),
+                .rejects = atomic64_read(&dev->zq_rejects),
+                .compress_ns = atomic64_read(&dev->zq_compress_ns),
+                .decompress_ops = atomic64_read(&dev->zq_decompress_ops),
+                .decompress_ns = atomic64_read(&dev->zq_decompress_ns),
+            };
+            cs.orig_bytes = cs.nr_compressed * READ_ONCE(dev->quantum);
+            return copy_to_user(uarg, &cs, sizeof(cs)) ? -EFAULT : 0;
+        }
+        case SCULL_IOC_SET_DEDUP:
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            if (get_user(val, (u32 __user *)uarg)) return -EFAULT;
+            WRITE_ONCE(dev->dedup, !!val);
+            return 0;
+        case SCULL_IOC_GET_DEDUP_STATS: {
+            struct scull_dedup_stats ds = {
+                .hashed = atomic64_read(&dev->dq_hashed),
+                .hits = atomic64_read(&dev->dq_hits),
+                .cow_breaks = atomic64_read(&dev->dq_breaks),
+            };
+            scull_dq_totals(&ds.shared_quanta, &ds.saved_bytes);
+            return copy_to_user(uarg, &ds, sizeof(ds)) ? -EFAULT : 0;
+        }
+        case SCULL_IOC_SNAPSHOT:
+            if (!(filp->f_mode & FMODE_READ)) return -EBADF;
+            if (get_user(val, (u32 __user *)uarg)) return -EFAULT;
+            return scull_ioctl_snapshot(filp, dev, (int)val);
+        case SCULL_IOC_SET_LIMIT: {
+            struct scull_limit lim;
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            if (copy_from_user(&lim, uarg, sizeof(lim))) return -EFAULT;
+            if (lim.flags & ~SCULL_LIMIT_BLOCK) return -EINVAL;
+            WRITE_ONCE(dev->limit_block, lim.flags & SCULL_LIMIT_BLOCK);
+            WRITE_ONCE(dev->limit, lim.bytes);
+            wake_up(&dev->space_wait);
+            return 0;
+        }
+        case SCULL_IOC_GET_LIMIT: {
+            struct scull_limit lim = {
+                .bytes = READ_ONCE(dev->limit),
+                .flags = READ_ONCE(dev->limit_block) ? SCULL_LIMIT_BLOCK : 0,
+                .reclaimed = atomic64_read(&dev->reclaimed_bytes),
+            };
+            lim.used = (u64)max(scull_nr_quanta(dev), 0L) * READ_ONCE(dev->quantum);
+            return copy_to_user(uarg, &lim, sizeof(lim)) ? -EFAULT : 0;
+        }
+        case SCULL_IOC_SAVE:
+        case SCULL_IOC_LOAD:
+            if (!(filp->f_mode & (cmd == SCULL_IOC_SAVE ? FMODE_READ : FMODE_WRITE))) return -EBADF;
+            if (get_user(val, (u32 __user *)uarg)) return -EFAULT;
+            return scull_ioctl_image(filp, dev, cmd == SCULL_IOC_SAVE, (int)val);
+        case SCULL_IOC_FALLOCATE:
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            return scull_ioctl_fallocate(filp, dev, uarg);
+        case SCULL_IOC_WRITE_RECS:
+            if (!(filp->f_mode & FMODE_WRITE)) return -EBADF;
+            return scull_ioctl_recs(sf, true, uarg);
+        case SCULL_IOC_READ_RECS:
+            if (!(filp->f_mode & FMODE_READ)) return -EBADF;
+            return scull_ioctl_recs(sf, false, uarg);
+        default:
+            return -ENOTTY;
+    } // switch
+} // scull_ioctl()
+
 
-// TODO
-//loff_t scull_llseek(struct file * filp, loff_t , int);
+static const struct pipe_buf_operations scull_pipe_buf_ops = {
+    .release = generic_pipe_buf_release,
+    .get = generic_pipe_buf_get,
+}; // pipe_buf_operations
 
 
+// scull_splice_read
+// hand quantum pages to the pipe by reference instead of copying them,
+// holes are spliced as the zero page
+// the pipe holds its own page reference, so a trim while data sits in the
+// pipe only drops the device's reference
+ssize_t scull_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+                          size_t len, unsigned int flags) {
+    scull_file *sf = filp->private_data;
+    scull_dev *dev = sf->dev;
+    loff_t pos = *ppos;
+    ssize_t retval = 0;
+    unsigned long size;
+
+    if (down_read_interruptible(&dev->sem)) return -ERESTARTSYS;
+    size = READ_ONCE(dev->size);
+    if (pos >= size) goto out;
+    if (pos + len > size) len = size - pos;
+
+    while (len) {
+        long q_pos = (long)pos % dev->quantum;
+        size_t chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(q_pos));
+        char *q = scull_get_quantum(sf, pos);
+        struct pipe_buffer buf = {
+            .offset = offset_in_page(q_pos),
+            .len = chunk,
+            .ops = &scull_pipe_buf_ops,
+        };
+        ssize_t added;
+
+        if (IS_ERR(q)) {
+            if (!retval) retval = PTR_ERR(q);
+            break;
+        } // if
+        buf.page = q ? scull_quantum_page(q, q_pos) : ZERO_PAGE(0);
+        get_page(buf.page);
+        added = add_to_pipe(pipe, &buf);
+        if (added < 0) {
+            if (!retval) retval = added;
+            break;
+        } // if
+        pos += added;
+        retval += added;
+        len -= added;
+    } // while
+    *ppos = pos;
+
+    out:
+        up_read(&dev->sem);
+        return retval;
+} // scull_splice_read()
+
+
+// scull_vma_fault
+// map the quantum page backing the faulting offset on demand
+// shared writable mappings allocate holes, everything else sees the zero page
+// until a write fills the hole and zaps it again
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf) {
+    struct vm_area_struct *vma = vmf->vma;
+    scull_file *sf = vma->vm_file->private_data;
+    scull_dev *dev = sf->dev;
+    loff_t pos = (loff_t)vmf->pgoff << PAGE_SHIFT;
+    bool alloc = (vma->vm_flags & (VM_SHARED | VM_WRITE)) == (VM_SHARED | VM_WRITE);
+    vm_fault_t ret = 0;
+    scull_qset *qs;
+    void *q;
+
+    /* zero pages can only be zapped through the inode the device pinned */
+    if (file_inode(vma->vm_file) != READ_ONCE(dev->mapped)) alloc = true;
+    down_read(&dev->sem);
+    if (pos >= READ_ONCE(dev->size)) {
+        ret = VM_FAULT_SIGBUS;
+        goto out;
+    } // if
+    if (alloc) {
+        q = scull_lock_quantum(sf, pos, &qs);
+        /* referenced before the qset lock drops, scull_dq_share leaves it alone from here */
+        if (q) {
+            vmf->page = scull_quantum_page(q, (long)pos % dev->quantum);
+            get_page(vmf->page);
+            mutex_unlock(&qs->lock);
+        } // if
+    } else {
+        /* pairs with scull_zap_hole, the flag is up before the slot is read */
+        if (!READ_ONCE(dev->zero_mapped)) WRITE_ONCE(dev->zero_mapped, true);
+        smp_mb();
+        q = scull_get_quantum(sf, pos);
+        if (!IS_ERR_OR_NULL(q)) {
+            vmf->page = scull_quantum_page(q, (long)pos % dev->quantum);
+            get_page(vmf->page);
+        } // if
+    } // if
+    if (IS_ERR(q)) {
+        /* a quantum that won't decompress is an I/O error, not an OOM */
+        ret = PTR_ERR(q) == -ENOMEM ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+    } else if (!q && alloc) {
+        ret = scull_over_limit(dev) ? VM_FAULT_SIGBUS : VM_FAULT_OOM;
+    } else if (!q) {
+        ret = vm_insert_page(vma, vmf->address, ZERO_PAGE(0)) ? VM_FAULT_SIGBUS
+                                                                : VM_FAULT_NOPAGE;
+        /* a write that filled the hole before the insert missed it, zap it here */
+        if (ret == VM_FAULT_NOPAGE && scull_get_quantum(sf, pos))
+            unmap_mapping_range(vma->vm_file->f_mapping, pos, PAGE_SIZE, 0);
+    } // if
+
+    out:
+        up_read(&dev->sem);
+        return ret;
+} // scull_vma_fault()
+
+
+// scull_vma_huge_fault
+// a PMD sized quantum backed by a single folio is mapped with one PMD entry
+// when the mapping lines up with it, anything else falls back to the
+// page sized fault above
+static vm_fault_t scull_vma_huge_fault(struct vm_fault *vmf, unsigned int order) {
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    struct vm_area_struct *vma = vmf->vma;
+    scull_file *sf = vma->vm_file->private_data;
+    scull_dev *dev = sf->dev;
+    unsigned long haddr = vmf->address & PMD_MASK;
+    loff_t pos = (loff_t)(vmf->pgoff - ((vmf->address - haddr) >> PAGE_SHIFT)) << PAGE_SHIFT;
+    bool alloc = (vma->vm_flags & (VM_SHARED | VM_WRITE)) == (VM_SHARED | VM_WRITE);
+    vm_fault_t ret = VM_FAULT_FALLBACK;
+    struct folio *folio = NULL;
+    scull_qset *qs;
+    void *q;
+
+    if (order != PMD_ORDER || READ_ONCE(dev->quantum) != PMD_SIZE) return VM_FAULT_FALLBACK;
+    if (haddr < vma->vm_start || haddr + PMD_SIZE > vma->vm_end) return VM_FAULT_FALLBACK;
+
+    down_read(&dev->sem);
+    if (dev->quantum != PMD_SIZE || pos % PMD_SIZE || pos >= READ_ONCE(dev->size)) goto out;
+    if (alloc) {
+        q = scull_lock_quantum(sf, pos, &qs);
+        /* as in scull_vma_fault, the folio is referenced under the qset lock */
+        if (q && !is_vmalloc_addr(q)) folio_get(folio = virt_to_folio(q));
+        if (q) mutex_unlock(&qs->lock);
+    } else {
+        q = scull_get_quantum(sf, pos);
+        if (!IS_ERR_OR_NULL(q) && !is_vmalloc_addr(q)) folio_get(folio = virt_to_folio(q));
+    } // if
+    if (folio) {
+        ret = vmf_insert_folio_pmd(vmf, folio, alloc);
+        folio_put(folio);
+    } // if
+
+    out:
+        up_read(&dev->sem);
+        return ret;
+#else
+    return VM_FAULT_FALLBACK;
+#endif
+} // scull_vma_huge_fault()
+
+
+static const struct vm_operations_struct scull_vm_ops = {
+    .fault = scull_vma_fault,
+    .huge_fault = scull_vma_huge_fault,
+}; // vm_operations_struct
+
+
+// scull_mmap
+// quanta are whole pages, so file offset N maps straight onto the page
+// holding byte N and no copy through read() is needed
+// 2 MiB quanta are mapped with PMDs, see scull_vma_huge_fault
+// read only shared mappings lose VM_MAYWRITE so the zero page can never
+// be made writable through mprotect
+// the first inode mapped is pinned so filling a hole can zap the zero page
+// it was mapped to, see scull_zap_hole
+int scull_mmap(struct file *filp, struct vm_area_struct *vma) {
+    scull_dev *dev = ((scull_file *)filp->private_data)->dev;
+    struct inode *inode = file_inode(filp);
+
+    if (!READ_ONCE(dev->mapped)) {
+        ihold(inode);
+        if (cmpxchg(&dev->mapped, NULL, inode)) iput(inode);
+    } // if
+    vma->vm_ops = &scull_vm_ops;
+    if ((vma->vm_flags & VM_SHARED) && !(vma->vm_flags & VM_WRITE))
+        vm_flags_clear(vma, VM_MAYWRITE);
+    vm_flags_set(vma, VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP);
+    return 0;
+} // scull_mmap()
+
 
+// scull_llseek
+// SEEK_DATA/SEEK_HOLE walk the sparse quantum store, everything past
+// dev->size is one implicit hole
+loff_t scull_llseek(struct file *filp, loff_t off, int whence) {
+    scull_file *sf = filp->private_data;
+    scull_dev *dev = sf->dev;
+    loff_t newpos;
 
+    switch (whence) {
+        case SEEK_SET:
+            newpos = off;
+            break;
+        case SEEK_CUR:
+            newpos = filp->f_pos + off;
+            break;
+        case SEEK_END:
+            newpos = READ_ONCE(dev->size) + off;
+            break;
+        case SEEK_DATA:
+        case SEEK_HOLE:
+            if (down_read_interruptible(&dev->sem)) return -ERESTARTSYS;
+            newpos = scull_seek_data(dev, off, whence == SEEK_DATA);
+            up_read(&dev->sem);
+            if (newpos < 0) return newpos;
+            break;
+        default:
+            return -EINVAL;
+    } // switch
+    if (newpos < 0) return -EINVAL;
+    filp->f_pos = newpos;
+    return newpos;
+} // scull_llseek()
@@ -3,6 +3,8 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
 #include "main.h"
 #include "util.h"
 
@@ -11,17 +13,23 @@
 
 // macros
 # define BASE_MINOR 0
-# define NUM_DEVICES 4
+# define NUM_DEVICES 4 /* default for the scull_nr_devs parameter */
+# define SCULL_MAX_MINORS (1 << 16) /* scull plus scullpipe minors */
+# define SCULL_FAULT_IN (64UL << 10) /* user bytes faulted in at a time, with no lock held */
+# define SCULL_APPEND_MAX (1UL << 20) /* largest O_APPEND record, bounced whole */
 
 // init and exit functions
 static int __init scull_init(void);
 static void __exit scull_exit(void);
-//loff_t scull_llseek(struct file *, loff_t, int); TODO
-ssize_t scull_read(struct file *, char __user *, size_t, loff_t *);
-ssize_t scull_write(struct file *, const char __user *, size_t, loff_t *);
-//int scull_ioctl(struct inode *, struct file *, unsigned int, unsigned long); replaced after 2.6.36
+loff_t scull_llseek(struct file *, loff_t, int);
+ssize_t scull_read_iter(struct kiocb *, struct iov_iter *);
+ssize_t scull_write_iter(struct kiocb *, struct iov_iter *);
+ssize_t scull_splice_read(struct file *, loff_t *, struct pipe_inode_info *, size_t, unsigned int);
+long scull_ioctl(struct file *, unsigned int, unsigned long); // .ioctl replaced after 2.6.36
 int scull_open(struct inode *, struct file *);
 int scull_release(struct inode *, struct file *);
+int scull_mmap(struct file *, struct vm_area_struct *);
+int scull_uring_cmd(struct io_uring_cmd *, unsigned int);
 
 // module init and exit
 module_init(scull_init);
@@ -30,26 +38,38 @@ module_exit(scull_exit);
 // license, versioining (not interopreble with OS versioning)
 MODULE_DESCRIPTION("Simple Character Utility for Loading Localities");
 MODULE_VERSION("1.0");
-MODULE_LICENSE("Dual BST/GPL");
+MODULE_LICENSE("Dual BSD/GPL");
 
 // other helper functions
-void scull_setup_cdev(struct scull_dev *, int);
+int scull_setup_cdev(void);
+static void scull_dev_destroy(struct scull_dev *);
+static struct scull_dev *scull_dev_create(void);
+static struct scull_dev *scull_get_dev(unsigned int);
+static int scull_read_procmem(struct seq_file *, void *);
+static unsigned long scull_shrink_count(struct shrinker *, struct shrink_control *);
+static unsigned long scull_shrink_scan(struct shrinker *, struct shrink_control *);
 
 
 // file_operations struct
-// many operations like mmap and poll not defined
+// many operations like poll not defined
 struct file_operations scull_fops = {
     .owner = THIS_MODULE, // ensure that module can't be unloaded while cdev's registered to this module
-    .read = scull_read,
-    .write = scull_write,
+    .read_iter = scull_read_iter, // read, readv and pread all go through the iter paths
+    .write_iter = scull_write_iter,
+    .splice_read = scull_splice_read,
+    .splice_write = iter_file_splice_write, // feeds pipe pages to write_iter as a bvec
     .open = scull_open,
     .release = scull_release,
-    //.llseek = scull_llseek, TODO
-    //.ioctl = scull_ioctl, replaced
+    .mmap = scull_mmap,
+    .get_unmapped_area = thp_get_unmapped_area, // PMD aligned addresses for 2 MiB quanta
+    .llseek = scull_llseek,
+    .unlocked_ioctl = scull_ioctl, // .ioctl replaced
+    .compat_ioctl = compat_ptr_ioctl, // structs are fixed width
+    .uring_cmd = scull_uring_cmd,
 }; // file_operations
 
 extern dev_t devno;
-extern scull_dev scull_devies[NUM_DEVICES];
+extern struct class *scull_class;
 
 
 #endif
\ No newline at end of file
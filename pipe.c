@@ -0,0 +1,177 @@
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+#include "pipe.h"
+
+
+static scull_pipe *scull_p_devices[SCULL_P_NR_DEVS];
+static dev_t scull_p_devno;
+static struct class *scull_p_class;
+
+
+// bytes ready for the consumer, pairs with the release store of head
+static size_t scull_p_avail(scull_pipe *p)
+{
+    return smp_load_acquire(&p->head) - p->tail;
+} // scull_p_avail()
+
+
+// bytes free for the producer, pairs with the release store of tail
+static size_t scull_p_space(scull_pipe *p)
+{
+    return p->size - (p->head - smp_load_acquire(&p->tail));
+} // scull_p_space()
+
+
+// scull_p_open
+static int scull_p_open(struct inode *inode, struct file *filp)
+{
+    filp->private_data = container_of(inode->i_cdev, scull_pipe, cdev);
+    return stream_open(inode, filp);
+} // scull_p_open()
+
+
+// scull_p_read
+// block (or -EAGAIN) until data is available, then drain what fits in one pass
+// the copy wraps at most once around the end of the ring
+static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    scull_pipe *p = filp->private_data;
+    size_t avail, off, first;
+
+    if (mutex_lock_interruptible(&p->rd_lock)) return -ERESTARTSYS;
+    while (!(avail = scull_p_avail(p))) {
+        mutex_unlock(&p->rd_lock);
+        if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+        if (wait_event_interruptible(p->inq, scull_p_avail(p)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&p->rd_lock)) return -ERESTARTSYS;
+    } // while
+
+    count = min(count, avail);
+    off = p->tail & (p->size - 1);
+    first = min(count, p->size - off);
+    if (copy_to_user(buf, p->buffer + off, first) ||
+        copy_to_user(buf + first, p->buffer, count - first)) {
+        mutex_unlock(&p->rd_lock);
+        return -EFAULT;
+    } // if
+    smp_store_release(&p->tail, p->tail + count);
+    mutex_unlock(&p->rd_lock);
+
+    if (wq_has_sleeper(&p->outq))
+        wake_up_interruptible(&p->outq);
+    return count;
+} // scull_p_read()
+
+
+// scull_p_write
+// block (or -EAGAIN) until there is room, then queue as much as fits
+static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+    scull_pipe *p = filp->private_data;
+    size_t space, off, first;
+
+    if (mutex_lock_interruptible(&p->wr_lock)) return -ERESTARTSYS;
+    while (!(space = scull_p_space(p))) {
+        mutex_unlock(&p->wr_lock);
+        if (filp->f_flags & O_NONBLOCK) return -EAGAIN;
+        if (wait_event_interruptible(p->outq, scull_p_space(p)))
+            return -ERESTARTSYS;
+        if (mutex_lock_interruptible(&p->wr_lock)) return -ERESTARTSYS;
+    } // while
+
+    count = min(count, space);
+    off = p->head & (p->size - 1);
+    first = min(count, p->size - off);
+    if (copy_from_user(p->buffer + off, buf, first) ||
+        copy_from_user(p->buffer, buf + first, count - first)) {
+        mutex_unlock(&p->wr_lock);
+        return -EFAULT;
+    } // if
+    smp_store_release(&p->head, p->head + count);
+    mutex_unlock(&p->wr_lock);
+
+    if (wq_has_sleeper(&p->inq))
+        wake_up_interruptible(&p->inq);
+    return count;
+} // scull_p_write()
+
+
+// scull_p_poll
+// readable while the ring holds data, writable while it has room
+static __poll_t scull_p_poll(struct file *filp, poll_table *wait)
+{
+    scull_pipe *p = filp->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(filp, &p->inq, wait);
+    poll_wait(filp, &p->outq, wait);
+    if (scull_p_avail(p)) mask |= EPOLLIN | EPOLLRDNORM;
+    if (scull_p_space(p)) mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+} // scull_p_poll()
+
+
+static struct file_operations scull_pipe_fops = {
+    .owner = THIS_MODULE,
+    .read = scull_p_read,
+    .write = scull_p_write,
+    .poll = scull_p_poll,
+    .open = scull_p_open,
+}; // file_operations
+
+
+// scull_p_init
+// allocate every scullpipe ring and register its cdev at firstdev + i
+int scull_p_init(dev_t firstdev, struct class *class)
+{
+    scull_p_devno = firstdev;
+    scull_p_class = class;
+    for (int i = 0; i < SCULL_P_NR_DEVS; ++i) {
+        scull_pipe *p = kzalloc(sizeof(scull_pipe), GFP_KERNEL);
+        if (!p) goto fail;
+        scull_p_devices[i] = p;
+        p->size = SCULL_P_BUFFER;
+        p->buffer = kvmalloc(p->size, GFP_KERNEL);
+        if (!p->buffer) goto fail;
+        mutex_init(&p->wr_lock);
+        mutex_init(&p->rd_lock);
+        init_waitqueue_head(&p->inq);
+        init_waitqueue_head(&p->outq);
+        cdev_init(&p->cdev, &scull_pipe_fops);
+        p->cdev.owner = THIS_MODULE;
+        if (cdev_add(&p->cdev, firstdev + i, 1)) {
+            printk(KERN_NOTICE "Error adding scullpipe%d", i);
+            kvfree(p->buffer);
+            kfree(p);
+            scull_p_devices[i] = NULL;
+            goto fail;
+        } // if
+        if (IS_ERR(device_create(class, NULL, firstdev + i, NULL, "scullpipe%d", i))) {
+            printk(KERN_NOTICE "Error creating scullpipe%d node", i);
+            goto fail;
+        } // if
+    } // for
+    return 0;
+    fail:
+        scull_p_cleanup();
+        return -ENOMEM;
+} // scull_p_init()
+
+
+// scull_p_cleanup
+void scull_p_cleanup(void)
+{
+    for (int i = 0; i < SCULL_P_NR_DEVS; ++i) {
+        scull_pipe *p = scull_p_devices[i];
+        if (!p) continue;
+        device_destroy(scull_p_class, scull_p_devno + i);
+        if (p->buffer) cdev_del(&p->cdev);
+        kvfree(p->buffer);
+        kfree(p);
+        scull_p_devices[i] = NULL;
+    } // for
+} // scull_p_cleanup()
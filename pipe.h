@@ -0,0 +1,43 @@
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
+
+#ifndef PIPE_H
+#define PIPE_H
+
+# define SCULL_P_NR_DEVS 1
+# define SCULL_P_BUFFER 65536 /* ring size in bytes, must be a power of two */
+
+
+// single ring buffer shared by every opener of a scullpipe minor
+// head only moves forward under the producer side, tail only under the
+// consumer side, and each side lives on its own cache line so one
+// producer and one consumer never write the same line
+// several producers (or consumers) serialize on their side's mutex only
+typedef struct scull_pipe {
+    char *buffer;                 /* ring storage, SCULL_P_BUFFER bytes */
+    size_t size;                  /* ring size, a power of two */
+    struct cdev cdev;             /* char device structure */
+
+    unsigned long head ____cacheline_aligned_in_smp; /* next byte to write */
+    struct mutex wr_lock;         /* serializes producers */
+    wait_queue_head_t outq;       /* writers waiting for space */
+
+    unsigned long tail ____cacheline_aligned_in_smp; /* next byte to read */
+    struct mutex rd_lock;         /* serializes consumers */
+    wait_queue_head_t inq;        /* readers waiting for data */
+} scull_pipe; // struct scull_pipe
+
+
+// set up and tear down the scullpipe minors starting at the given dev_t
+// a struct device is created in the class for each so udev makes the node
+int scull_p_init(dev_t, struct class *);
+void scull_p_cleanup(void);
+
+
+# endif
@@ -0,0 +1,209 @@
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#ifndef SCULL_IOCTL_H
+#define SCULL_IOCTL_H
+
+// ioctl interface shared by the module and user space programs
+
+# define SCULL_IOC_MAGIC 'k'
+
+# define SCULL_REC_MAX (1 << 20) /* records accepted in one batch */
+# define SCULL_REC_CHUNK 64      /* records copied in from user space at a time */
+
+
+// one record of a batched read or write
+// result comes back as the byte count transferred or a negative errno
+struct scull_rec {
+    __u64 offset;  /* device offset */
+    __u64 len;     /* bytes to transfer */
+    __u64 buf;     /* user buffer address */
+    __s64 result;  /* filled in by the driver */
+}; // struct scull_rec
+
+
+// argument of SCULL_IOC_WRITE_RECS and SCULL_IOC_READ_RECS
+struct scull_rec_batch {
+    __u64 recs;    /* user address of a struct scull_rec array */
+    __u32 count;   /* number of records */
+    __u32 flags;   /* reserved, must be zero */
+}; // struct scull_rec_batch
+
+
+// both return the number of records processed
+# define SCULL_IOC_WRITE_RECS _IOW(SCULL_IOC_MAGIC, 1, struct scull_rec_batch)
+# define SCULL_IOC_READ_RECS  _IOW(SCULL_IOC_MAGIC, 2, struct scull_rec_batch)
+
+// device geometry, quantum must be a power of two number of pages
+// SET changes the default restored by trim and applies at once to an empty
+// device, GET reports the geometry of the current contents
+# define SCULL_IOC_SET_QUANTUM  _IOW(SCULL_IOC_MAGIC, 3, __u32)
+# define SCULL_IOC_GET_QUANTUM  _IOR(SCULL_IOC_MAGIC, 4, __u32)
+# define SCULL_IOC_SET_QSET     _IOW(SCULL_IOC_MAGIC, 5, __u32)
+# define SCULL_IOC_GET_QSET     _IOR(SCULL_IOC_MAGIC, 6, __u32)
+# define SCULL_IOC_SET_ADAPTIVE _IOW(SCULL_IOC_MAGIC, 7, __u32) /* nonzero enables */
+
+
+// io_uring passthrough, submitted as IORING_OP_URING_CMD on a ring created
+// with IORING_SETUP_SQE128, the struct below lives in sqe->cmd and the
+// op goes in sqe->cmd_op
+# define SCULL_URING_READ       1 /* read len bytes at offset into addr */
+# define SCULL_URING_WRITE      2 /* write len bytes from addr at offset */
+# define SCULL_URING_TRIM       3 /* drop the device contents */
+# define SCULL_URING_WRITE_RECS 4 /* addr points at a struct scull_rec_batch */
+# define SCULL_URING_READ_RECS  5 /* addr points at a struct scull_rec_batch */
+
+
+// cqe->res carries the byte count, record count or -errno
+struct scull_uring_cmd {
+    __u64 offset;  /* device offset */
+    __u64 addr;    /* user buffer or batch address */
+    __u64 len;     /* bytes to transfer */
+    __u64 flags;   /* reserved, must be zero */
+}; // struct scull_uring_cmd
+
+
+// NUMA placement of new quanta
+# define SCULL_NUMA_LOCAL      0 /* on the writing cpu's node (default) */
+# define SCULL_NUMA_BIND       1 /* only on numa_node */
+# define SCULL_NUMA_INTERLEAVE 2 /* quantum index round robin over online nodes */
+
+
+struct scull_numa {
+    __u32 policy;  /* SCULL_NUMA_* */
+    __s32 node;    /* target node for SCULL_NUMA_BIND */
+}; // struct scull_numa
+
+
+// per node occupancy, the driver fills usage[i] with the bytes held on
+// node i for the first nr_nodes nodes and sets nr_nodes to nr_node_ids
+struct scull_numa_usage {
+    __u64 usage;   /* user address of a __u64 array */
+    __u32 nr_nodes;
+    __u32 pad;
+}; // struct scull_numa_usage
+
+
+# define SCULL_IOC_SET_NUMA       _IOW(SCULL_IOC_MAGIC, 8, struct scull_numa)
+# define SCULL_IOC_GET_NUMA       _IOR(SCULL_IOC_MAGIC, 9, struct scull_numa)
+# define SCULL_IOC_GET_NUMA_USAGE _IOWR(SCULL_IOC_MAGIC, 10, struct scull_numa_usage)
+
+
+// progress of the background frees behind O_WRONLY truncation
+struct scull_trim_stats {
+    __u64 queued;        /* trimmed generations handed to the workqueue */
+    __u64 done;          /* generations fully freed */
+    __u64 pending;       /* quanta still waiting to be freed */
+    __u64 freed_bytes;   /* bytes freed in the background */
+}; // struct scull_trim_stats
+
+
+# define SCULL_IOC_GET_TRIM_STATS _IOR(SCULL_IOC_MAGIC, 11, struct scull_trim_stats)
+
+
+// transparent compression of cold quanta, SCULL_IOC_SET_COMPRESS takes the
+// idle interval in ms after which a qset's quanta are compressed, 0 turns
+// it off, the compression ratio is orig_bytes / stored_bytes
+struct scull_compress_stats {
+    __u64 interval_ms;
+    __u64 nr_compressed;   /* quanta held compressed */
+    __u64 orig_bytes;      /* their uncompressed size */
+    __u64 stored_bytes;    /* what they take compressed */
+    __u64 compress_ops;    /* compression attempts */
+    __u64 rejects;         /* attempts that didn't save a quarter */
+    __u64 compress_ns;     /* total time compressing */
+    __u64 decompress_ops;
+    __u64 decompress_ns;   /* total time decompressing on access */
+}; // struct scull_compress_stats
+
+
+# define SCULL_IOC_SET_COMPRESS       _IOW(SCULL_IOC_MAGIC, 12, __u32)
+# define SCULL_IOC_GET_COMPRESS_STATS _IOR(SCULL_IOC_MAGIC, 13, struct scull_compress_stats)
+
+
+// deduplication of identical quanta, SCULL_IOC_SET_DEDUP takes nonzero to
+// hash quanta as they are written in full, the first three counters are the
+// device's own and the last two cover every device
+struct scull_dedup_stats {
+    __u64 hashed;          /* full quanta hashed on write */
+    __u64 hits;            /* of those, shared with an identical quantum */
+    __u64 cow_breaks;      /* shared quanta copied on a later write */
+    __u64 shared_quanta;   /* distinct quanta in the dedup table */
+    __u64 saved_bytes;     /* memory saved by the extra references */
+}; // struct scull_dedup_stats
+
+
+# define SCULL_IOC_SET_DEDUP       _IOW(SCULL_IOC_MAGIC, 14, __u32)
+# define SCULL_IOC_GET_DEDUP_STATS _IOR(SCULL_IOC_MAGIC, 15, struct scull_dedup_stats)
+
+
+// copy on write snapshot of this device into the scull device behind a
+// file descriptor opened for writing, whose previous contents are dropped,
+// both sides share the data until one writes it and then only the written
+// quantum is copied
+# define SCULL_IOC_SNAPSHOT _IOW(SCULL_IOC_MAGIC, 16, __s32)
+
+
+// per device byte quota, 0 bytes removes it, writes past the quota fail with
+// ENOSPC unless SCULL_LIMIT_BLOCK makes them wait for a trim
+// used and reclaimed are only filled in by SCULL_IOC_GET_LIMIT
+# define SCULL_LIMIT_BLOCK 1
+struct scull_limit {
+    __u64 bytes;           /* quota, 0 for none */
+    __u32 flags;           /* SCULL_LIMIT_* */
+    __u32 pad;
+    __u64 used;            /* bytes of quanta charged to the device */
+    __u64 reclaimed;       /* bytes given back under memory pressure */
+}; // struct scull_limit
+
+
+# define SCULL_IOC_SET_LIMIT _IOW(SCULL_IOC_MAGIC, 17, struct scull_limit)
+# define SCULL_IOC_GET_LIMIT _IOR(SCULL_IOC_MAGIC, 18, struct scull_limit)
+
+
+// device image, SCULL_IOC_SAVE and SCULL_IOC_LOAD take a file descriptor
+// opened for writing or reading and stream the device to or from offset 0
+// layout: the header, nr_extents extents in ascending order, then starting
+// at data_offset one quantum sized payload per quantum the extents cover
+// holes are left out, fields are in host byte order
+# define SCULL_IMAGE_MAGIC   0x4d494353 /* "SCIM" */
+# define SCULL_IMAGE_VERSION 1
+struct scull_image_header {
+    __u32 magic;
+    __u32 version;
+    __u32 quantum;         /* quantum size the image was taken with */
+    __u32 qset;
+    __u64 size;            /* device size in bytes */
+    __u64 nr_extents;
+    __u64 nr_quanta;       /* payloads, the sum of the extent counts */
+    __u64 data_offset;     /* page aligned offset of the first payload */
+}; // struct scull_image_header
+
+
+struct scull_image_extent {
+    __u64 first;           /* quantum index of the run */
+    __u64 count;           /* populated quanta in it */
+}; // struct scull_image_extent
+
+
+# define SCULL_IOC_SAVE _IOW(SCULL_IOC_MAGIC, 19, __s32)
+# define SCULL_IOC_LOAD _IOW(SCULL_IOC_MAGIC, 20, __s32)
+
+
+// fallocate for the device, with no mode bits [offset, offset + len) gets
+// its quanta up front and the size grows to cover it, so writes there never
+// allocate, the flags match FALLOC_FL_KEEP_SIZE and FALLOC_FL_PUNCH_HOLE
+# define SCULL_FALLOC_KEEP_SIZE  0x01 /* preallocate without changing the size */
+# define SCULL_FALLOC_PUNCH_HOLE 0x02 /* free the range, zeroing partial quanta */
+struct scull_falloc {
+    __u64 offset;
+    __u64 len;
+    __u32 mode;            /* SCULL_FALLOC_* */
+    __u32 pad;
+}; // struct scull_falloc
+
+
+# define SCULL_IOC_FALLOCATE _IOW(SCULL_IOC_MAGIC, 21, struct scull_falloc)
+
+
+# endif
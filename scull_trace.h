@@ -0,0 +1,109 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(SCULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SCULL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+
+// open, with trimmed set when O_WRONLY emptied the device
+TRACE_EVENT(scull_open,
+    TP_PROTO(unsigned int minor, unsigned int flags, bool trimmed),
+    TP_ARGS(minor, flags, trimmed),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, flags)
+        __field(bool, trimmed)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->flags = flags;
+        __entry->trimmed = trimmed;
+    ),
+    TP_printk("minor=%u flags=0x%x trimmed=%d", __entry->minor, __entry->flags, __entry->trimmed)
+);
+
+
+TRACE_EVENT(scull_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+    TP_printk("minor=%u", __entry->minor)
+);
+
+
+// one read or write, quanta is the number of quanta the transferred bytes
+// span, wait_ns the time spent blocked on dev->sem and duration_ns the
+// whole call
+DECLARE_EVENT_CLASS(scull_rw,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t len, ssize_t ret, int quantum,
+             u64 wait_ns, u64 duration_ns),
+    TP_ARGS(minor, pos, len, ret, quantum, wait_ns, duration_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(ssize_t, ret)
+        __field(unsigned long, quanta)
+        __field(u64, wait_ns)
+        __field(u64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->len = len;
+        __entry->ret = ret;
+        __entry->quanta = ret > 0 ? (pos + ret - 1) / quantum - pos / quantum + 1 : 0;
+        __entry->wait_ns = wait_ns;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("minor=%u pos=%lld len=%zu ret=%zd quanta=%lu wait_ns=%llu duration_ns=%llu",
+              __entry->minor, __entry->pos, __entry->len, __entry->ret, __entry->quanta,
+              __entry->wait_ns, __entry->duration_ns)
+);
+
+DEFINE_EVENT(scull_rw, scull_read,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t len, ssize_t ret, int quantum,
+             u64 wait_ns, u64 duration_ns),
+    TP_ARGS(minor, pos, len, ret, quantum, wait_ns, duration_ns)
+);
+
+DEFINE_EVENT(scull_rw, scull_write,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t len, ssize_t ret, int quantum,
+             u64 wait_ns, u64 duration_ns),
+    TP_ARGS(minor, pos, len, ret, quantum, wait_ns, duration_ns)
+);
+
+
+// a trim, quanta is what the device held when it was detached
+TRACE_EVENT(scull_trim,
+    TP_PROTO(unsigned int minor, long quanta, u64 duration_ns),
+    TP_ARGS(minor, quanta, duration_ns),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(long, quanta)
+        __field(u64, duration_ns)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->quanta = quanta;
+        __entry->duration_ns = duration_ns;
+    ),
+    TP_printk("minor=%u quanta=%ld duration_ns=%llu", __entry->minor, __entry->quanta,
+              __entry->duration_ns)
+);
+
+#endif /* SCULL_TRACE_H */
+
+/* this part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+// user space benchmark for the scull quantum store
+// fills the device, then times pread at sequential or random offsets
+// with max_threads > 1 the pread phase is repeated with 1, 2, 4, ...
+// max_threads threads sharing one fd to show how reads scale
+// build: gcc -O2 -pthread -o scull_bench scull_bench.c
+// usage: ./scull_bench /dev/scull0 <size_mb> <ops> <seq|rand> [io_size] [max_threads]
+
+#define DEFAULT_IO_SIZE 4096
+
+struct reader {
+    pthread_t thread;
+    int fd;
+    unsigned int seed;
+    long ops;
+    int random_offsets;
+    size_t io_size;
+    off_t span;
+    int failed;
+};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *reader_main(void *arg) {
+    struct reader *r = arg;
+    char *buf = malloc(r->io_size);
+    if (!buf) {
+        r->failed = 1;
+        return NULL;
+    }
+    for (long i = 0; i < r->ops; i++) {
+        off_t off = r->random_offsets
+            ? ((off_t)rand_r(&r->seed) * RAND_MAX + rand_r(&r->seed)) % r->span
+            : (off_t)((r->seed + i) * r->io_size) % r->span;
+        if (pread(r->fd, buf, r->io_size, off) != (ssize_t)r->io_size) {
+            perror("pread");
+            r->failed = 1;
+            break;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// run ops preads per thread on nthreads threads, returns wall time in ns
+static double run_readers(int fd, int nthreads, long ops, int random_offsets,
+                          size_t io_size, off_t span) {
+    struct reader *readers = calloc(nthreads, sizeof(*readers));
+    double start = now_ns();
+    for (int t = 0; t < nthreads; t++) {
+        readers[t] = (struct reader){ .fd = fd, .seed = t + 1, .ops = ops,
+                                      .random_offsets = random_offsets,
+                                      .io_size = io_size, .span = span };
+        pthread_create(&readers[t].thread, NULL, reader_main, &readers[t]);
+    }
+    int failed = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(readers[t].thread, NULL);
+        failed |= readers[t].failed;
+    }
+    double elapsed = now_ns() - start;
+    free(readers);
+    return failed ? -1 : elapsed;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 5) {
+        fprintf(stderr, "usage: %s <device> <size_mb> <ops> <seq|rand> [io_size] [max_threads]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argv[1];
+    off_t size = (off_t)atol(argv[2]) << 20;
+    long ops = atol(argv[3]);
+    int random_offsets = !strcmp(argv[4], "rand");
+    size_t io_size = argc > 5 ? (size_t)atol(argv[5]) : DEFAULT_IO_SIZE;
+    int max_threads = argc > 6 ? atoi(argv[6]) : 1;
+    char *buf = malloc(io_size);
+    if (!buf || size < (off_t)io_size || max_threads < 1) {
+        fprintf(stderr, "bad size arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    // 1. Fill the device, O_WRONLY trims it first
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        perror("Failed to open device for writing");
+        return EXIT_FAILURE;
+    }
+    memset(buf, 'x', io_size);
+    double start = now_ns();
+    for (off_t off = 0; off < size; off += io_size) {
+        if (write(fd, buf, io_size) != (ssize_t)io_size) {
+            perror("write");
+            return EXIT_FAILURE;
+        }
+    }
+    double fill_ns = now_ns() - start;
+    close(fd);
+    printf("fill:  %.1f MB/s\n", (double)size / (1 << 20) / (fill_ns / 1e9));
+
+    // 2. Time preads, doubling the thread count up to max_threads
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Failed to open device for reading");
+        return EXIT_FAILURE;
+    }
+    for (int nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+        double read_ns = run_readers(fd, nthreads, ops, random_offsets, io_size,
+                                     size - io_size);
+        if (read_ns < 0) return EXIT_FAILURE;
+        printf("%s pread, %d thread(s): %.0f ns/op, %.1f MB/s\n",
+               random_offsets ? "rand" : "seq", nthreads, read_ns / ops,
+               (double)nthreads * ops * io_size / (1 << 20) / (read_ns / 1e9));
+    }
+    close(fd);
+    free(buf);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,138 @@
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/xarray.h>
+#include "stats.h"
+
+
+static struct dentry *scull_debugfs_root;
+
+
+// scull_stats_sum
+// fold every cpu's counters into one snapshot, a reader racing an update
+// may miss it but never sees a torn counter
+static void scull_stats_sum(scull_dev *dev, scull_stats *sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        scull_stats *s = per_cpu_ptr(dev->stats, cpu);
+        sum->reads += READ_ONCE(s->reads);
+        sum->read_bytes += READ_ONCE(s->read_bytes);
+        sum->writes += READ_ONCE(s->writes);
+        sum->write_bytes += READ_ONCE(s->write_bytes);
+        sum->alloc_fail += READ_ONCE(s->alloc_fail);
+        sum->sem_contended += READ_ONCE(s->sem_contended);
+        sum->sem_wait_ns += READ_ONCE(s->sem_wait_ns);
+        for (int op = 0; op < SCULL_LAT_NR; op++)
+            for (int b = 0; b < SCULL_LAT_BUCKETS; b++)
+                sum->lat[op][b] += READ_ONCE(s->lat[op][b]);
+    } // for_each_possible_cpu
+} // scull_stats_sum()
+
+
+// scull_count_qsets
+// walks the xarray, only done when someone reads the stats
+static unsigned long scull_count_qsets(scull_dev *dev)
+{
+    unsigned long idx, nr = 0;
+    scull_qset *qs;
+
+    down_read(&dev->sem);
+    xa_for_each(dev->qsets, idx, qs) nr++;
+    up_read(&dev->sem);
+    return nr;
+} // scull_count_qsets()
+
+
+// scull_stats_summary
+void scull_stats_summary(struct seq_file *m, scull_dev *dev, unsigned int index)
+{
+    seq_printf(m, "scull%u: size %lu quantum %d qset %d qsets %lu quanta %ld\n",
+               index, READ_ONCE(dev->size), READ_ONCE(dev->quantum), READ_ONCE(dev->qset),
+               scull_count_qsets(dev), scull_nr_quanta(dev));
+} // scull_stats_summary()
+
+
+// scull_stats_show
+// debugfs scull<n>/stats
+static int scull_stats_show(struct seq_file *m, void *v)
+{
+    scull_dev *dev = m->private;
+    scull_stats sum;
+
+    scull_stats_sum(dev, &sum);
+    /* charged quanta in full plus what compressed ones actually take up */
+    seq_printf(m, "size %lu\nbytes_stored %lld\n", READ_ONCE(dev->size),
+               (s64)max(scull_nr_quanta(dev), 0L) * READ_ONCE(dev->quantum) +
+               atomic64_read(&dev->zq_stored));
+    seq_printf(m, "quantum %d\nqset %d\n", READ_ONCE(dev->quantum), READ_ONCE(dev->qset));
+    seq_printf(m, "stripes %u\n", dev->nr_stripes);
+    seq_printf(m, "qsets %lu\nquanta %ld\n", scull_count_qsets(dev), scull_nr_quanta(dev));
+    seq_printf(m, "reads %llu\nread_bytes %llu\n", sum.reads, sum.read_bytes);
+    seq_printf(m, "writes %llu\nwrite_bytes %llu\n", sum.writes, sum.write_bytes);
+    seq_printf(m, "alloc_fail %llu\n", sum.alloc_fail);
+    seq_printf(m, "limit %lu\nreclaimed_bytes %lld\n", READ_ONCE(dev->limit),
+               atomic64_read(&dev->reclaimed_bytes));
+    seq_printf(m, "sem_contended %llu\nsem_wait_ns %llu\n", sum.sem_contended, sum.sem_wait_ns);
+    return 0;
+} // scull_stats_show()
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+
+// scull_latency_show
+// debugfs scull<n>/latency, one line per non empty bucket [2^b, 2^(b+1)) ns
+static int scull_latency_show(struct seq_file *m, void *v)
+{
+    static const char * const names[SCULL_LAT_NR] = { "read", "write", "trim" };
+    scull_dev *dev = m->private;
+    scull_stats sum;
+
+    scull_stats_sum(dev, &sum);
+    for (int op = 0; op < SCULL_LAT_NR; op++) {
+        seq_printf(m, "%s:\n", names[op]);
+        for (int b = 0; b < SCULL_LAT_BUCKETS; b++) {
+            if (!sum.lat[op][b]) continue;
+            seq_printf(m, "  >= %llu ns: %llu\n", 1ULL << b, sum.lat[op][b]);
+        } // for
+    } // for
+    return 0;
+} // scull_latency_show()
+DEFINE_SHOW_ATTRIBUTE(scull_latency);
+
+
+// scull_debugfs_init
+// debugfs errors are deliberately ignored, the driver works without it
+void scull_debugfs_init(void)
+{
+    scull_debugfs_root = debugfs_create_dir("scull", NULL);
+} // scull_debugfs_init()
+
+
+// scull_debugfs_exit
+void scull_debugfs_exit(void)
+{
+    debugfs_remove_recursive(scull_debugfs_root);
+} // scull_debugfs_exit()
+
+
+// scull_debugfs_add
+void scull_debugfs_add(scull_dev *dev, unsigned int index)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "scull%u", index);
+    dev->debugfs = debugfs_create_dir(name, scull_debugfs_root);
+    debugfs_create_file("stats", 0444, dev->debugfs, dev, &scull_stats_fops);
+    debugfs_create_file("latency", 0444, dev->debugfs, dev, &scull_latency_fops);
+} // scull_debugfs_add()
+
+
+// scull_debugfs_remove
+void scull_debugfs_remove(scull_dev *dev)
+{
+    debugfs_remove_recursive(dev->debugfs);
+    dev->debugfs = NULL;
+} // scull_debugfs_remove()
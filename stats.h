@@ -0,0 +1,99 @@
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include "util.h"
+
+#ifndef STATS_H
+#define STATS_H
+
+# define SCULL_LAT_BUCKETS 32 /* log2 ns buckets, the last one takes everything from ~2 s */
+
+enum scull_lat_op {
+    SCULL_LAT_READ,
+    SCULL_LAT_WRITE,
+    SCULL_LAT_TRIM,
+    SCULL_LAT_NR,
+}; // enum scull_lat_op
+
+
+// per cpu counters of one device, only ever touched with this_cpu ops on the
+// hot path and summed over every cpu when someone reads them
+typedef struct scull_stats {
+    u64 reads, read_bytes;
+    u64 writes, write_bytes;
+    u64 alloc_fail;          /* qset, array or quantum allocations that failed */
+    u64 sem_contended;       /* dev->sem acquisitions that had to wait */
+    u64 sem_wait_ns;         /* time spent waiting for it */
+    u64 lat[SCULL_LAT_NR][SCULL_LAT_BUCKETS];
+} scull_stats; // struct scull_stats
+
+
+# define scull_stat_inc(dev, field) this_cpu_inc((dev)->stats->field)
+# define scull_stat_add(dev, field, val) this_cpu_add((dev)->stats->field, (val))
+
+
+// scull_stat_latency
+// account the time since start, in ns, to the op's log2 histogram
+static inline void scull_stat_latency(struct scull_dev *dev, int op, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    int b = min_t(int, ilog2(ns | 1), SCULL_LAT_BUCKETS - 1);
+
+    this_cpu_inc(dev->stats->lat[op][b]);
+} // scull_stat_latency()
+
+
+// scull_lock_read
+// down_read_interruptible on dev->sem or one of its stripes that counts the
+// waits, the uncontended case costs one trylock, the time spent blocked
+// goes to *wait_ns
+static inline int scull_lock_read(struct scull_dev *dev, struct rw_semaphore *sem, u64 *wait_ns)
+{
+    u64 start;
+    int err;
+
+    *wait_ns = 0;
+    if (down_read_trylock(sem)) return 0;
+    start = ktime_get_ns();
+    err = down_read_interruptible(sem);
+    *wait_ns = ktime_get_ns() - start;
+    scull_stat_inc(dev, sem_contended);
+    scull_stat_add(dev, sem_wait_ns, *wait_ns);
+    return err;
+} // scull_lock_read()
+
+
+// scull_lock_write
+// down_write_killable counterpart of scull_lock_read, takes the stripes
+// as well, see scull_stripes_lock
+static inline int scull_lock_write(struct scull_dev *dev, u64 *wait_ns)
+{
+    u64 start;
+    int err;
+
+    *wait_ns = 0;
+    if (!down_write_trylock(&dev->sem)) {
+        start = ktime_get_ns();
+        err = down_write_killable(&dev->sem);
+        *wait_ns = ktime_get_ns() - start;
+        scull_stat_inc(dev, sem_contended);
+        scull_stat_add(dev, sem_wait_ns, *wait_ns);
+        if (err) return err;
+    } // if
+    scull_stripes_lock(dev);
+    return 0;
+} // scull_lock_write()
+
+
+// create and remove /sys/kernel/debug/scull and a directory per device
+void scull_debugfs_init(void);
+void scull_debugfs_exit(void);
+void scull_debugfs_add(struct scull_dev *, unsigned int);
+void scull_debugfs_remove(struct scull_dev *);
+
+// one /proc/scullmem line for a device
+void scull_stats_summary(struct seq_file *, struct scull_dev *, unsigned int);
+
+# endif
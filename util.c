@@ -1,28 +1,960 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/wait_bit.h>
+#include <linux/sched/signal.h>
 #include "util.h"
+#include "compress.h"
+#include "dedup.h"
+#include "stats.h"
+#include "scull_trace.h"
 
 
+static struct kmem_cache *scull_qset_cache;
+struct workqueue_struct *scull_wq;
+
+
+// a detached generation of a device's qsets waiting to be freed by scull_trim_work
+typedef struct scull_graveyard {
+    struct work_struct work;
+    scull_dev *dev;          /* device the quanta are returned to */
+    struct xarray *qsets;    /* the detached qsets */
+    int quantum;             /* geometry of the detached data */
+    int qset;
+} scull_graveyard; // struct scull_graveyard
+
+
+// scull_cache_init
+// qset arrays are fixed size, so give them their own slab instead of
+// going through the generic kmalloc buckets
+// quanta are whole pages straight from the page allocator so they can be mmapped
+// also creates the workqueue for trims and cold scans
+int scull_cache_init(void)
+{
+    scull_qset_cache = kmem_cache_create("scull_qset", SCULL_QSET_SIZE * sizeof(void *),
+                                         0, 0, NULL);
+    if (!scull_qset_cache) return -ENOMEM;
+    scull_wq = alloc_workqueue("scull", WQ_UNBOUND, 0);
+    if (!scull_wq) {
+        kmem_cache_destroy(scull_qset_cache);
+        return -ENOMEM;
+    } // if
+    return 0;
+} // scull_cache_init()
+
+
+// scull_cache_exit
+// every device must have been destroyed first
+void scull_cache_exit(void)
+{
+    destroy_workqueue(scull_wq);
+    kmem_cache_destroy(scull_qset_cache);
+} // scull_cache_exit()
+
+
+// scull_release_quantum
+// drop the device's reference, pages still mapped or spliced survive
+// until their last user lets go
+void scull_release_quantum(void *q)
+{
+    if (is_vmalloc_addr(q))
+        vfree(q);
+    else
+        folio_put(virt_to_folio(q));
+} // scull_release_quantum()
+
+
+// scull_quantum_page
+struct page *scull_quantum_page(void *q, long off)
+{
+    if (is_vmalloc_addr(q)) return vmalloc_to_page((char *)q + off);
+    return virt_to_page((char *)q + off);
+} // scull_quantum_page()
+
+
+// scull_quantum_node
+// node the qi'th quantum of the device should live on under its NUMA policy
+int scull_quantum_node(scull_dev *dev, unsigned long qi)
+{
+    int node, n;
+
+    switch (READ_ONCE(dev->numa_policy)) {
+        case SCULL_NUMA_BIND:
+            return READ_ONCE(dev->numa_node);
+        case SCULL_NUMA_INTERLEAVE:
+            n = qi % num_online_nodes();
+            for_each_online_node(node)
+                if (!n--) return node;
+            fallthrough;
+        default:
+            return numa_node_id();
+    } // switch
+} // scull_quantum_node()
+
+
+// scull_alloc_quantum
+// take a recycled quantum from this cpu's pool, falling back to the page allocator
+// pooled quanta sitting on the wrong node for this slot are released rather
+// than handed out, bound devices never spill onto another node
+// quanta larger than a page are folios, so a 2 MiB quantum can be mapped
+// with one PMD and freed with one put, when fragmentation defeats the
+// high order allocation the quantum is built from order-0 pages with vzalloc
+// force skips the quota, for quanta that only come back from compression
+void *scull_alloc_quantum(scull_dev *dev, unsigned long qi, bool force)
+{
+    int order = get_order(dev->quantum);
+    int node = scull_quantum_node(dev, qi);
+    gfp_t gfp = GFP_KERNEL | __GFP_ZERO;
+    struct folio *folio;
+    scull_qpool *pool;
+    void *q;
+
+    if (!force && scull_over_limit(dev)) return NULL;
+    pool = get_cpu_ptr(dev->pool);
+    q = pool->count ? pool->q[--pool->count] : NULL;
+    put_cpu_ptr(dev->pool);
+
+    if (READ_ONCE(dev->numa_policy) == SCULL_NUMA_BIND) gfp |= __GFP_THISNODE;
+    if (q && page_to_nid(virt_to_page(q)) != node) {
+        scull_release_quantum(q);
+        q = NULL;
+    } // if
+    if (q) {
+        memset(q, 0, dev->quantum);
+    } else if (!order) {
+        struct page *page = alloc_pages_node(node, gfp, 0);
+        q = page ? page_address(page) : NULL;
+    } else {
+        folio = __folio_alloc_node(gfp | __GFP_NOWARN | __GFP_NORETRY, order, node);
+        q = folio ? folio_address(folio) : vzalloc_node(dev->quantum, node);
+    } // if
+    if (q) scull_charge(dev, q);
+    else scull_stat_inc(dev, alloc_fail);
+    return q;
+} // scull_alloc_quantum()
+
+
+// scull_free_quantum
+// park the quantum in this cpu's pool, once the pool hits the high
+// watermark release half of it back to the page allocator in one go
+// the watermark shrinks with the quantum order so big quanta don't pile up
+// quanta that are still mapped, came from the vzalloc fallback, or are not
+// of the device's current quantum size are released instead of pooled
+// caller must hold dev->sem so the quantum size can't change under it
+void scull_free_quantum(scull_dev *dev, void *q, int quantum)
+{
+    int high = max(SCULL_POOL_HIGH >> get_order(dev->quantum), 1);
+    scull_qpool *pool;
+
+    if (!q) return;
+    scull_uncharge(dev, q);
+    if (quantum != dev->quantum || is_vmalloc_addr(q) || folio_ref_count(virt_to_folio(q)) > 1) {
+        scull_release_quantum(q);
+        return;
+    } // if
+    pool = get_cpu_ptr(dev->pool);
+    if (pool->count >= high) {
+        while (pool->count > high / 2)
+            scull_release_quantum(pool->q[--pool->count]);
+    } // if
+    pool->q[pool->count++] = q;
+    put_cpu_ptr(dev->pool);
+} // scull_free_quantum()
+
+
+// scull_pool_drain
+// hand every pooled quantum back to the page allocator, used on device
+// teardown, whenever the quantum size changes and by the shrinker
+// caller must hold dev->sem for writing, returns the quanta released
+long scull_pool_drain(scull_dev *dev)
+{
+    long nr = 0;
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        scull_qpool *pool = per_cpu_ptr(dev->pool, cpu);
+        nr += pool->count;
+        while (pool->count)
+            scull_release_quantum(pool->q[--pool->count]);
+    } // for_each_possible_cpu
+    return nr;
+} // scull_pool_drain()
+
+
+// scull_pool_count
+// racy sum for the shrinker's count pass
+long scull_pool_count(scull_dev *dev)
+{
+    long nr = 0;
+    int cpu;
+    for_each_possible_cpu(cpu)
+        nr += READ_ONCE(per_cpu_ptr(dev->pool, cpu)->count);
+    return nr;
+} // scull_pool_count()
+
+
+// scull_charge
+// count a quantum against the device and its node
+void scull_charge(scull_dev *dev, void *q)
+{
+    atomic_long_inc(&dev->node_quanta[page_to_nid(scull_quantum_page(q, 0))]);
+} // scull_charge()
+
+
+// scull_uncharge
+// and stop counting it, waking writers blocked on the quota
+void scull_uncharge(scull_dev *dev, void *q)
+{
+    atomic_long_dec(&dev->node_quanta[page_to_nid(scull_quantum_page(q, 0))]);
+    if (READ_ONCE(dev->limit) && wq_has_sleeper(&dev->space_wait))
+        wake_up(&dev->space_wait);
+} // scull_uncharge()
+
+
+// scull_over_limit
+// true when one more quantum would take the device past its quota
+// quanta only waiting for a background trim to free them don't count
+bool scull_over_limit(scull_dev *dev)
+{
+    unsigned long limit = READ_ONCE(dev->limit);
+    long used;
+
+    if (!limit) return false;
+    used = max(scull_nr_quanta(dev) - atomic_long_read(&dev->trim_pending), 0L);
+    return (unsigned long)(used + 1) * READ_ONCE(dev->quantum) > limit;
+} // scull_over_limit()
+
+
+// scull_alloc_qset_data
+// the slab only covers the default qset size, tuned sizes use kvzalloc
+// the array goes on the node its first quantum is placed on
+void **scull_alloc_qset_data(scull_dev *dev, int node)
+{
+    if (dev->qset == SCULL_QSET_SIZE)
+        return kmem_cache_alloc_node(scull_qset_cache, GFP_KERNEL | __GFP_ZERO, node);
+    return kvzalloc_node(size_mul(dev->qset, sizeof(void *)), GFP_KERNEL, node);
+} // scull_alloc_qset_data()
+
+
+// scull_free_qset_data
+// qset is the size the array was allocated with
+void scull_free_qset_data(int qset, void **data)
+{
+    if (!data) return;
+    if (qset == SCULL_QSET_SIZE)
+        kmem_cache_free(scull_qset_cache, data);
+    else
+        kvfree(data);
+} // scull_free_qset_data()
+
+
+// scull_check_numa
+int scull_check_numa(int policy, int node)
+{
+    switch (policy) {
+        case SCULL_NUMA_BIND:
+            if (node < 0 || node >= MAX_NUMNODES || !node_online(node)) return -EINVAL;
+            return 0;
+        case SCULL_NUMA_LOCAL:
+        case SCULL_NUMA_INTERLEAVE:
+            return 0;
+        default:
+            return -EINVAL;
+    } // switch
+} // scull_check_numa()
+
+
+// scull_set_numa
+// change where future quanta are placed, existing quanta stay put
+int scull_set_numa(scull_dev *dev, int policy, int node)
+{
+    int err = scull_check_numa(policy, node);
+    if (err) return err;
+    if (policy != SCULL_NUMA_BIND) node = NUMA_NO_NODE;
+    WRITE_ONCE(dev->numa_node, node);
+    WRITE_ONCE(dev->numa_policy, policy);
+    return 0;
+} // scull_set_numa()
+
+
+// scull_check_geometry
+// quanta must be a power of two number of pages so they stay mmappable
+int scull_check_geometry(long quantum, long qset)
+{
+    if (quantum < PAGE_SIZE || quantum > SCULL_QUANTUM_MAX || !is_power_of_2(quantum))
+        return -EINVAL;
+    if (qset < 1 || qset > SCULL_QSET_MAX) return -EINVAL;
+    return 0;
+} // scull_check_geometry()
+
+
+// scull_set_geometry
+// switch an empty device to a new quantum/qset size
+// pooled quanta of the old size are released
+// caller must hold dev->sem for writing and the device must be empty
+void scull_set_geometry(scull_dev *dev, int quantum, int qset)
+{
+    if (dev->quantum != quantum) scull_pool_drain(dev);
+    dev->quantum = quantum;
+    dev->qset = qset;
+    atomic_long_inc(&dev->gen);
+} // scull_set_geometry()
+
+
+// scull_nr_quanta
+// quanta currently charged to the device, including detached generations
+// that have not been freed yet
+long scull_nr_quanta(scull_dev *dev)
+{
+    long nr = 0;
+    for (int node = 0; node < nr_node_ids; node++)
+        nr += atomic_long_read(&dev->node_quanta[node]);
+    return nr;
+} // scull_nr_quanta()
+
+
+// scull_qset_uncharge
+// the owner of a qset still shared with a snapshot lets go of it, its plain
+// quanta stop counting against the owner and are freed uncharged later
+static long scull_qset_uncharge(scull_dev *dev, scull_qset *qs, int qset)
+{
+    long nr = 0;
+
+    for (int i = 0; qs->data && i < qset; i++) {
+        void *q = qs->data[i];
+        if (!q || scull_is_zq(q) || scull_is_dq(q)) continue;
+        scull_uncharge(dev, q);
+        nr++;
+    } // for
+    qs->owner = NULL;
+    return nr;
+} // scull_qset_uncharge()
+
+
+// scull_qset_free_slot
+// free whatever slot i holds, plain quanta go back to the owner's pool or
+// straight to the page allocator when nobody is charged for them
+// returns whether a charged quantum was released
+static bool scull_qset_free_slot(scull_dev *dev, scull_qset *qs, int i, int quantum)
+{
+    void *q = qs->data[i];
+
+    if (!q) return false;
+    if (scull_is_zq(q)) {
+        scull_zq_free(dev, q);
+    } else if (scull_is_dq(q)) {
+        scull_dq_put(scull_dq_ptr(q));
+    } else if (qs->owner) {
+        scull_free_quantum(dev, q, quantum);
+        return true;
+    } else {
+        scull_release_quantum(q);
+    } // if
+    return false;
+} // scull_qset_free_slot()
+
+
+// scull_qset_put
+// the last holder frees the quanta
+long scull_qset_put(scull_dev *dev, scull_qset *qs, int quantum, int qset)
+{
+    long released = 0;
+    bool last;
+
+    mutex_lock(&qs->lock);
+    WRITE_ONCE(qs->ref, qs->ref - 1);
+    last = !qs->ref;
+    if (!last && qs->owner == dev) released = scull_qset_uncharge(dev, qs, qset);
+    mutex_unlock(&qs->lock);
+    if (!last) return released;
+
+    if (qs->data) {
+        for (int i = 0; i < qset; i++)
+            released += scull_qset_free_slot(dev, qs, i, quantum);
+        scull_free_qset_data(qset, qs->data);
+    } // if
+    kfree(qs);
+    return released;
+} // scull_qset_put()
+
+
+// scull_free_qsets
+// put every qset of a detached generation of the given geometry
+// with lock set dev->sem is taken for reading one qset at a time, so
+// quanta can go back into the pool without blocking a trim for long
+static void scull_free_qsets(scull_dev *dev, struct xarray *qsets, int quantum, int qset, bool lock)
+{
+    scull_qset *dptr;
+    unsigned long idx;
+
+    xa_for_each(qsets, idx, dptr) { /* all the populated qsets */
+        long freed;
+        if (lock) down_read(&dev->sem);
+        freed = scull_qset_put(dev, dptr, quantum, qset);
+        if (lock) {
+            atomic_long_sub(freed, &dev->trim_pending);
+            atomic64_add((u64)freed * quantum, &dev->trim_freed_bytes);
+            up_read(&dev->sem);
+            cond_resched();
+        } // if
+    } // xa_for_each
+    xa_destroy(qsets);
+} // scull_free_qsets()
+
+
+// scull_trim_work
+static void scull_trim_work(struct work_struct *work)
+{
+    scull_graveyard *g = container_of(work, scull_graveyard, work);
+
+    scull_free_qsets(g->dev, g->qsets, g->quantum, g->qset, true);
+    atomic64_inc(&g->dev->trims_done);
+    kfree(g->qsets);
+    kfree(g);
+} // scull_trim_work()
+
 
 // trim functionality to clear the device's memory
-// kernal mode disallows page faults, hence kfree
+// the populated qsets are swapped for an empty xarray in O(1) and the old
+// generation is freed on scull_wq, quanta are recycled into the device pool
+// for the rewrite that follows and the geometry falls back to the defaults
+// if the swap can't be allocated the old generation is freed inline
+// caller must hold dev->sem for writing
 int scull_trim(scull_dev *dev)
 {
-    scull_qset *next, *dptr;
-    int qset = dev->qset;
-    for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-        if (dptr->data) {
-            for (int i = 0; i < qset; i++)
-                kfree(dptr->data[i]);
-            kfree(dptr->data);
-            dptr->data = NULL;
-        } // if
-        next = dptr->next;
-        kfree(dptr);
-    } // for
+    u64 start = ktime_get_ns();
+    long nr = trace_scull_trim_enabled() ?
+              scull_nr_quanta(dev) - atomic_long_read(&dev->trim_pending) : 0;
+
+    scull_dq_flush(dev);
+    if (!xa_empty(dev->qsets)) {
+        struct xarray *fresh = kmalloc(sizeof(*fresh), GFP_KERNEL);
+        scull_graveyard *g = kmalloc(sizeof(*g), GFP_KERNEL);
+
+        if (fresh && g) {
+            xa_init(fresh);
+            g->dev = dev;
+            g->qsets = dev->qsets;
+            g->quantum = dev->quantum;
+            g->qset = dev->qset;
+            dev->qsets = fresh;
+            /* the device is empty now, every charged quantum is awaiting a free */
+            atomic_long_set(&dev->trim_pending, scull_nr_quanta(dev));
+            atomic64_inc(&dev->trims_queued);
+            INIT_WORK(&g->work, scull_trim_work);
+            queue_work(scull_wq, &g->work);
+        } else {
+            kfree(fresh);
+            kfree(g);
+            scull_free_qsets(dev, dev->qsets, dev->quantum, dev->qset, false);
+        } // if
+    } // if
     dev->size = 0;
-    dev->quantum = SCULL_QUANTUM_SIZE
-    dev->qset = SCULL_QSET_SIZE;
-    dev->data = NULL;
+    atomic_long_set(&dev->tail, 0);
+    scull_set_geometry(dev, dev->def_quantum, dev->def_qset);
+    /* writers blocked on the quota see the room once dev->sem is dropped */
+    if (READ_ONCE(dev->limit)) wake_up(&dev->space_wait);
+    scull_stat_latency(dev, SCULL_LAT_TRIM, start);
+    if (trace_scull_trim_enabled())
+        trace_scull_trim(dev->minor, nr, ktime_get_ns() - start);
     return 0;
  } // scull_trim()
+
+
+// scull_snapshot
+// dst drops its old contents and takes a reference on every qset of src,
+// so the cost is one xarray store per qset whatever the data volume
+int scull_snapshot(scull_dev *src, scull_dev *dst)
+{
+    scull_qset *qs;
+    unsigned long idx;
+
+    scull_trim(dst);
+    scull_set_geometry(dst, src->quantum, src->qset);
+    xa_for_each(src->qsets, idx, qs) {
+        if (xa_is_err(xa_store(dst->qsets, idx, qs, GFP_KERNEL))) {
+            scull_trim(dst);
+            return -ENOMEM;
+        } // if
+        mutex_lock(&qs->lock);
+        WRITE_ONCE(qs->ref, qs->ref + 1);
+        mutex_unlock(&qs->lock);
+    } // xa_for_each
+    dst->size = src->size;
+    atomic_long_set(&dst->tail, src->size);
+    return 0;
+} // scull_snapshot()
+
+
+// scull_trim_flush
+// wait for every queued trim to finish freeing, used before a device goes away
+void scull_trim_flush(void)
+{
+    flush_workqueue(scull_wq);
+} // scull_trim_flush()
+
+
+// scull_stripes_lock
+// every stripe after dev->sem, with dev->sem as the nest lock so lockdep
+// accepts any number of them
+void scull_stripes_lock(scull_dev *dev)
+{
+    for (unsigned int i = 0; i < dev->nr_stripes; i++)
+        down_write_nest_lock(&dev->stripes[i].sem, &dev->sem);
+} // scull_stripes_lock()
+
+
+// scull_stripes_trylock
+// all or nothing
+bool scull_stripes_trylock(scull_dev *dev)
+{
+    for (unsigned int i = 0; i < dev->nr_stripes; i++) {
+        if (down_write_trylock(&dev->stripes[i].sem)) continue;
+        while (i--) up_write(&dev->stripes[i].sem);
+        return false;
+    } // for
+    return true;
+} // scull_stripes_trylock()
+
+
+// scull_stripes_unlock
+void scull_stripes_unlock(scull_dev *dev)
+{
+    for (unsigned int i = dev->nr_stripes; i--; )
+        up_write(&dev->stripes[i].sem);
+} // scull_stripes_unlock()
+
+
+// scull_stripe_of
+// read without any lock, the caller checks the answer again once it holds
+// the stripe since the geometry only changes with every stripe held
+// an empty device goes through dev->sem so the adaptive quantum still
+// works, as does a range crossing qsets
+long scull_stripe_of(scull_dev *dev, loff_t pos, size_t len)
+{
+    long itemsize = (long)READ_ONCE(dev->quantum) * READ_ONCE(dev->qset);
+
+    if (!dev->nr_stripes || !len || pos < 0 || !READ_ONCE(dev->size)) return -1;
+    if ((long)pos / itemsize != ((long)pos + (long)len - 1) / itemsize) return -1;
+    return ((long)pos / itemsize) & (dev->nr_stripes - 1);
+} // scull_stripe_of()
+
+
+// an O_APPEND record whose writer was killed waiting for its turn to commit,
+// the commit that brings dev->size up to start carries it on to end
+typedef struct scull_append_hole {
+    struct list_head node;   /* on dev->append_holes */
+    unsigned long start, end;
+} scull_append_hole; // struct scull_append_hole
+
+
+// scull_raise_size
+static void scull_raise_size(scull_dev *dev, unsigned long end)
+{
+    unsigned long size = READ_ONCE(dev->size);
+
+    while (size < end) {
+        unsigned long old = cmpxchg(&dev->size, size, end);
+        if (old == size) break;
+        size = old;
+    } // while
+} // scull_raise_size()
+
+
+// scull_append_drain
+// move dev->size across every abandoned record it has reached
+static void scull_append_drain(scull_dev *dev)
+{
+    scull_append_hole *h;
+    bool moved = false;
+
+    spin_lock(&dev->append_lock);
+    restart:
+    list_for_each_entry(h, &dev->append_holes, node) {
+        if (h->start > READ_ONCE(dev->size)) continue;
+        scull_raise_size(dev, h->end);
+        list_del(&h->node);
+        kfree(h);
+        moved = true;
+        goto restart;
+    } // list_for_each_entry
+    spin_unlock(&dev->append_lock);
+    if (moved) wake_up_var(&dev->size);
+} // scull_append_drain()
+
+
+// scull_extend_size
+// the append tail is pushed along first, so an append that reserves after
+// a reader saw the new size can't land inside it
+// a cmpxchg that moves size is fully ordered, so either this sees a hole
+// queued behind the new size or scull_append_abandon sees the new size
+void scull_extend_size(scull_dev *dev, unsigned long end)
+{
+    long tail = atomic_long_read(&dev->tail);
+
+    while (tail < (long)end && !atomic_long_try_cmpxchg(&dev->tail, &tail, end))
+        ;
+    scull_raise_size(dev, end);
+    if (unlikely(!list_empty_careful(&dev->append_holes))) scull_append_drain(dev);
+} // scull_extend_size()
+
+
+// scull_append_abandon
+// a killed appender hands its range to whoever commits up to start, or
+// commits it itself if that already happened
+void scull_append_abandon(scull_dev *dev, unsigned long start, unsigned long end)
+{
+    scull_append_hole *h = kmalloc(sizeof(*h), GFP_KERNEL | __GFP_NOFAIL);
+
+    h->start = start;
+    h->end = end;
+    spin_lock(&dev->append_lock);
+    if (READ_ONCE(dev->size) < start) {
+        list_add_tail(&h->node, &dev->append_holes);
+        h = NULL;
+    } // if
+    spin_unlock(&dev->append_lock);
+    if (h) {
+        kfree(h);
+        scull_extend_size(dev, end);
+        wake_up_var(&dev->size);
+        return;
+    } // if
+    /* pairs with the cmpxchg in scull_extend_size */
+    smp_mb();
+    if (READ_ONCE(dev->size) >= start) scull_append_drain(dev);
+} // scull_append_abandon()
+
+
+// scull_qset_unshare
+// the first write into a qset shared with a snapshot gives this device its
+// own copy of the pointer array, the quanta stay shared by reference and
+// are only copied one by one as they get written
+// readers of this device may still be walking the shared qset, so its
+// reference is retired rather than put
+static scull_qset *scull_qset_unshare(scull_dev *dev, scull_qset *old, long item)
+{
+    scull_qset *qs = NULL, *cur;
+
+    mutex_lock(&old->lock);
+    cur = xa_load(dev->qsets, item);
+    if (cur != old || old->ref == 1) {
+        mutex_unlock(&old->lock);
+        return cur;
+    } // if
+    qs = kzalloc(sizeof(scull_qset), GFP_KERNEL);
+    if (!qs) goto fail;
+    qs->index = item;
+    qs->atime = jiffies;
+    qs->ref = 1;
+    qs->owner = dev;
+    mutex_init(&qs->lock);
+    if (old->data) {
+        qs->data = scull_alloc_qset_data(dev, scull_quantum_node(dev, (unsigned long)item * dev->qset));
+        if (!qs->data) goto fail;
+        for (int i = 0; i < dev->qset; i++) {
+            void *q = old->data[i];
+            if (!q) continue;
+            q = scull_is_zq(q) ? scull_zq_dup(dev, q) : scull_dq_get(dev, old, i);
+            if (!q) goto fail;
+            qs->data[i] = q;
+        } // for
+    } // if
+    if (scull_dq_retire_qset(dev, old)) goto fail;
+    xa_store(dev->qsets, item, qs, GFP_KERNEL); /* replaces old, can't fail */
+    mutex_unlock(&old->lock);
+    atomic_long_inc(&dev->gen);
+    return qs;
+
+    fail:
+        mutex_unlock(&old->lock);
+        if (qs) scull_qset_put(dev, qs, dev->quantum, dev->qset);
+        return NULL;
+} // scull_qset_unshare()
+
+
+// scull_follow
+// the xarray gives the same lookup cost at any offset, the file cache
+// only saves the lookup for back to back accesses in one qset
+// racing writers insert with xa_cmpxchg, the loser frees its copy
+// writers get a private qset, see scull_qset_unshare
+// caller must hold dev->sem
+scull_qset *scull_follow(scull_file *sf, long item, bool alloc)
+{
+    scull_dev *dev = sf->dev;
+    unsigned long gen = READ_ONCE(sf->cache_gen);
+    scull_qset *qs, *old;
+
+    smp_rmb();
+    qs = READ_ONCE(sf->cache_qs);
+    if (qs && gen == atomic_long_read(&dev->gen) && qs->index == item)
+        goto out;
+
+    gen = atomic_long_read(&dev->gen);
+    smp_rmb();
+    qs = xa_load(dev->qsets, item);
+    if (!qs) {
+        if (!alloc) return NULL;
+        qs = kzalloc(sizeof(scull_qset), GFP_KERNEL);
+        if (!qs) {
+            scull_stat_inc(dev, alloc_fail);
+            return NULL;
+        } // if
+        qs->index = item;
+        qs->atime = jiffies;
+        qs->ref = 1;
+        qs->owner = dev;
+        mutex_init(&qs->lock);
+        old = xa_cmpxchg(dev->qsets, item, NULL, qs, GFP_KERNEL);
+        if (old) {
+            kfree(qs);
+            if (xa_is_err(old)) return NULL;
+            qs = old;
+        } // if
+    } // if
+
+    WRITE_ONCE(sf->cache_qs, qs);
+    smp_wmb();
+    WRITE_ONCE(sf->cache_gen, gen);
+
+    out:
+        if (alloc && READ_ONCE(qs->ref) > 1) {
+            qs = scull_qset_unshare(dev, qs, item);
+            if (!qs) return NULL;
+        } // if
+        if (READ_ONCE(qs->atime) != jiffies) WRITE_ONCE(qs->atime, jiffies);
+        return qs;
+} // scull_follow()
+
+
+// scull_get_quantum
+// maps a byte offset to its qset and quantum slot without taking any
+// qset lock, pairs with the release stores in scull_lock_quantum
+// a compressed quantum is inflated under the qset lock first, which can
+// fail with an ERR_PTR
+void *scull_get_quantum(scull_file *sf, loff_t pos)
+{
+    scull_dev *dev = sf->dev;
+    long itemsize = (long)dev->quantum * dev->qset;
+    int s_pos = ((long)pos % itemsize) / dev->quantum;
+    scull_qset *dptr = scull_follow(sf, (long)pos / itemsize, false);
+    void **data;
+    void *q;
+
+    if (!dptr) return NULL;
+    data = smp_load_acquire(&dptr->data);
+    if (!data) return NULL;
+    q = smp_load_acquire(&data[s_pos]);
+    if (scull_is_zq(q)) {
+        mutex_lock(&dptr->lock);
+        q = scull_zq_inflate(dev, dptr, s_pos);
+        mutex_unlock(&dptr->lock);
+    } else if (scull_is_dq(q)) {
+        q = scull_dq_ptr(q);
+    } // if
+    return q;
+} // scull_get_quantum()
+
+
+// scull_zap_hole
+// a read only or private mapping may have the zero page in for a hole that
+// was just filled, the slot store is ordered before the zero_mapped check
+// so either this sees the flag or scull_vma_fault sees the filled slot
+void scull_zap_hole(scull_dev *dev, loff_t pos, loff_t len)
+{
+    struct inode *inode;
+
+    smp_mb();
+    if (!READ_ONCE(dev->zero_mapped)) return;
+    inode = READ_ONCE(dev->mapped);
+    if (inode) unmap_mapping_range(inode->i_mapping, pos, len, 0);
+} // scull_zap_hole()
+
+
+// scull_own_slot
+// make the slot of quantum qi a private plain quantum, filling in the qset
+// array and quantum as needed and publishing each only after it is zeroed
+// so lockless readers never see stale memory
+// caller holds qs->lock, returns NULL if an allocation fails
+static void *scull_own_slot(scull_dev *dev, scull_qset *qs, unsigned long qi)
+{
+    int s_pos = qi % dev->qset;
+    void *q;
+
+    if (!qs->data) {
+        int node = scull_quantum_node(dev, (unsigned long)qs->index * dev->qset);
+        void **data = scull_alloc_qset_data(dev, node);
+        if (!data) {
+            scull_stat_inc(dev, alloc_fail);
+            return NULL;
+        } // if
+        smp_store_release(&qs->data, data);
+    } // if
+    q = qs->data[s_pos];
+    if (scull_is_zq(q)) {
+        q = scull_zq_inflate(dev, qs, s_pos);
+        if (IS_ERR(q)) return NULL;
+    } // if
+    if (scull_is_dq(q)) {
+        q = scull_dq_break(dev, qs, s_pos);
+        if (IS_ERR(q)) return NULL;
+    } // if
+    if (!q) {
+        q = scull_alloc_quantum(dev, qi, false);
+        if (q) {
+            smp_store_release(&qs->data[s_pos], q);
+            scull_zap_hole(dev, (loff_t)qi * dev->quantum, dev->quantum);
+        } // if
+    } // if
+    return q;
+} // scull_own_slot()
+
+
+// scull_lock_quantum
+void *scull_lock_quantum(scull_file *sf, loff_t pos, scull_qset **qsp)
+{
+    scull_dev *dev = sf->dev;
+    long itemsize = (long)dev->quantum * dev->qset;
+    scull_qset *dptr = scull_follow(sf, (long)pos / itemsize, true);
+    void *q;
+
+    if (!dptr) return NULL;
+    mutex_lock(&dptr->lock);
+    q = scull_own_slot(dev, dptr, (unsigned long)(pos / dev->quantum));
+    if (!q) {
+        mutex_unlock(&dptr->lock);
+        return NULL;
+    } // if
+    *qsp = dptr;
+    return q;
+} // scull_lock_quantum()
+
+
+// scull_prealloc
+// give every quantum of [pos, end) a private plain quantum up front so
+// writes there never allocate, taking each qset lock once for all of its
+// quanta rather than once per quantum
+// stops at the first allocation failure or fatal signal, leaving what was
+// filled in place
+// caller must hold dev->sem for reading
+int scull_prealloc(scull_file *sf, loff_t pos, loff_t end)
+{
+    scull_dev *dev = sf->dev;
+    unsigned long qi = pos / dev->quantum, last = DIV_ROUND_UP(end, dev->quantum);
+
+    while (qi < last) {
+        unsigned long item = qi / dev->qset;
+        unsigned long stop = min(last, (item + 1) * dev->qset);
+        scull_qset *qs = scull_follow(sf, item, true);
+        bool ok = qs;
+
+        if (qs) {
+            mutex_lock(&qs->lock);
+            for (; ok && qi < stop; qi++)
+                ok = scull_own_slot(dev, qs, qi);
+            mutex_unlock(&qs->lock);
+        } // if
+        if (!ok) return scull_over_limit(dev) ? -ENOSPC : -ENOMEM;
+        if (fatal_signal_pending(current)) return -EINTR;
+        cond_resched();
+    } // while
+    return 0;
+} // scull_prealloc()
+
+
+// scull_zero_range
+// zero [pos, end) of one quantum in place if the quantum exists
+static int scull_zero_range(scull_file *sf, loff_t pos, loff_t end)
+{
+    scull_qset *qs;
+    void *q;
+
+    if (pos >= end) return 0;
+    q = scull_get_quantum(sf, pos);
+    if (IS_ERR_OR_NULL(q)) return PTR_ERR_OR_ZERO(q);
+    q = scull_lock_quantum(sf, pos, &qs);
+    if (!q) return -ENOMEM;
+    memset(q + (long)pos % sf->dev->quantum, 0, end - pos);
+    mutex_unlock(&qs->lock);
+    return 0;
+} // scull_zero_range()
+
+
+// scull_punch_hole
+// the partial quanta at either end of [pos, end) are zeroed in place and
+// the whole ones freed, qsets the hole covers entirely are dropped outright
+// the file caches are invalidated before each dropped qset is put
+// caller must hold dev->sem for writing
+int scull_punch_hole(scull_file *sf, loff_t pos, loff_t end)
+{
+    scull_dev *dev = sf->dev;
+    unsigned long quantum = dev->quantum, qset = dev->qset;
+    unsigned long first = DIV_ROUND_UP(pos, quantum), last = end / quantum;
+    unsigned long item;
+    scull_qset *qs;
+    int err;
+
+    if (first > last) return scull_zero_range(sf, pos, end);
+    err = scull_zero_range(sf, pos, (loff_t)first * quantum);
+    if (!err) err = scull_zero_range(sf, (loff_t)last * quantum, end);
+    if (err || first == last) return err;
+
+    xa_for_each_range(dev->qsets, item, qs, first / qset, (last - 1) / qset) {
+        unsigned long lo = max(first, item * qset), hi = min(last, (item + 1) * qset);
+
+        if (hi - lo == qset) {
+            xa_erase(dev->qsets, item);
+            atomic_long_inc(&dev->gen);
+            scull_qset_put(dev, qs, quantum, qset);
+        } else {
+            qs = scull_follow(sf, item, true);
+            if (!qs) return -ENOMEM;
+            for (; qs->data && lo < hi; lo++) {
+                scull_qset_free_slot(dev, qs, lo % qset, quantum);
+                qs->data[lo % qset] = NULL;
+            } // for
+        } // if
+        cond_resched();
+    } // xa_for_each_range
+    return 0;
+} // scull_punch_hole()
+
+
+// scull_seek_data
+// steps one quantum at a time, but SEEK_DATA skips whole missing qsets
+// with xa_find so a mostly empty device is crossed in a few lookups
+loff_t scull_seek_data(scull_dev *dev, loff_t pos, bool data)
+{
+    long quantum = dev->quantum, qset = dev->qset;
+    loff_t size = READ_ONCE(dev->size);
+    unsigned long qi, last;
+
+    if (pos < 0 || pos >= size) return -ENXIO;
+    last = (size - 1) / quantum;
+    for (qi = pos / quantum; qi <= last; qi++) {
+        unsigned long item = qi / qset;
+        scull_qset *qs;
+        void **arr;
+        bool present;
+
+        if (data) {
+            qs = xa_find(dev->qsets, &item, ULONG_MAX, XA_PRESENT);
+            if (!qs) break;
+            if (item != qi / qset) qi = item * qset;
+            if (qi > last) break;
+        } else {
+            qs = xa_load(dev->qsets, item);
+        } // if
+        arr = qs ? smp_load_acquire(&qs->data) : NULL;
+        present = arr && smp_load_acquire(&arr[qi % qset]);
+        if (present == data)
+            return max_t(loff_t, pos, (loff_t)qi * quantum);
+    } // for
+    return data ? -ENXIO : size;
+} // scull_seek_data()
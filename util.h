@@ -2,36 +2,228 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/fs.h>
-#include <linux/semaphore.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
 #include <linux/cdev.h>
+#include <linux/xarray.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/workqueue.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/cache.h>
+#include "scull_ioctl.h"
 
 #ifndef UTIL_H
 #define UTIL_H
 
-# define SCULL_QUANTUM_SIZE 4000;
-# define SCULL_QSET_SIZE 1000;
+# define SCULL_QUANTUM_SIZE PAGE_SIZE /* one page per quantum so quanta can be mmapped */
+# define SCULL_QSET_SIZE 1000
+# define SCULL_QUANTUM_MAX (2UL << 20) /* largest tunable quantum, 2 MiB */
+# define SCULL_QSET_MAX (1 << 20)
+# define SCULL_ADAPT_SMALL (64UL << 10) /* adaptive quantum for writes of at least 64 KiB */
+# define SCULL_ADAPT_LARGE SCULL_QUANTUM_MAX /* and for writes of at least 2 MiB */
+# define SCULL_POOL_HIGH 64 /* free pages of quanta kept per cpu before going back to the allocator */
+# define SCULL_STRIPES_MAX 256 /* stripes of a striped device */
 
 
+// one dense array of qset quantum pointers
+// qsets are indexed by (offset / (quantum * qset)) in scull_dev.qsets
+// readers walk data locklessly, writers filling it take lock
+// a snapshot shares whole qsets between devices, a shared qset is never
+// written, the first write through either device gives it its own copy
 typedef struct scull_qset {
     void **data;
-    struct scull_qset *next;
+    long index;              /* key of this qset in scull_dev.qsets */
+    unsigned long atime;     /* jiffies of the last access, for the cold scan */
+    int ref;                 /* devices holding it, changed under lock */
+    struct scull_dev *owner; /* device its plain quanta are charged to, NULL once it let go */
+    struct mutex lock;       /* serializes writers within this qset */
 } scull_qset; // struct scull_qset
 
 
+// per cpu stack of free quanta, refilled by trim and drawn by write
+typedef struct scull_qpool {
+    int count;
+    void *q[SCULL_POOL_HIGH];
+} scull_qpool; // struct scull_qpool
+
+
+// one lock stripe of a striped device, qset item i belongs to stripe
+// i % nr_stripes and reads and writes that stay inside one qset take only
+// their stripe's sem, so writers in different stripes don't share a lock
+// they still share the xarray when a qset is created, and writers that
+// extend the device share the size line at the end of scull_dev
+typedef struct scull_stripe {
+    struct rw_semaphore sem;
+} ____cacheline_aligned_in_smp scull_stripe; // struct scull_stripe
+
+
+struct scull_stats;
+
+
 typedef struct scull_dev {
-    struct scull_qset *data; /* pointer to first quantum set */
-    int quantum;             /* current quantum set */
-    int qset;                /* number of quantum sets */
-    unsigned long size;      /* amount of data stored here */
+    struct xarray *qsets;    /* qset index -> scull_qset, swapped out by trim */
+    int quantum;             /* quantum size of the current contents */
+    int qset;                /* quanta per qset of the current contents */
+    int def_quantum;         /* quantum size restored by trim */
+    int def_qset;            /* qset size restored by trim */
+    bool adaptive;           /* pick the quantum from the first write */
+    int numa_policy;         /* SCULL_NUMA_*, where new quanta are placed */
+    int numa_node;           /* target node for SCULL_NUMA_BIND */
+    atomic_long_t *node_quanta; /* quanta held per node, nr_node_ids long */
+    atomic_long_t gen;       /* bumped by trim and unshare, invalidates file caches */
+    scull_qpool __percpu *pool; /* recycled quanta */
     unsigned int access_key; /* later used by sculluid and scullpriv */
-    struct semaphore sem;    /* mutual exclusion semaphore */
-    struct cdev cdev;        /* char device structure */
+    struct rw_semaphore sem; /* shared by read/write, exclusive for trim */
+    atomic64_t trims_queued; /* generations handed to the trim workqueue */
+    atomic64_t trims_done;   /* generations fully freed */
+    atomic_long_t trim_pending;    /* detached quanta still waiting to be freed */
+    atomic64_t trim_freed_bytes;   /* quantum bytes freed in the background */
+    unsigned int compress_ms;      /* compress qsets idle this long, 0 disables */
+    struct delayed_work compress_work; /* periodic cold scan, see compress.c */
+    atomic64_t zq_count;           /* quanta currently held compressed */
+    atomic64_t zq_stored;          /* compressed bytes held for them */
+    atomic64_t zq_compress_ops;    /* compression attempts */
+    atomic64_t zq_rejects;         /* attempts that didn't shrink enough */
+    atomic64_t zq_compress_ns;     /* time spent compressing */
+    atomic64_t zq_decompress_ops;
+    atomic64_t zq_decompress_ns;
+    bool dedup;                    /* share identical quanta, see dedup.c */
+    atomic64_t dq_hashed;          /* full quanta hashed on write */
+    atomic64_t dq_hits;            /* of those, shared with an existing quantum */
+    atomic64_t dq_breaks;          /* copies made when writing a shared quantum */
+    struct llist_head dq_retired;  /* quanta waiting for readers to drain */
+    atomic_t dq_nr_retired;
+    struct work_struct dq_work;    /* puts the retired quanta */
+    struct scull_stats __percpu *stats; /* counters and latency histograms, see stats.h */
+    struct dentry *debugfs;        /* scull<n> directory under debugfs */
+    unsigned int minor;            /* for tracepoints */
+    unsigned long limit;           /* quota on charged quanta in bytes, 0 for none */
+    bool limit_block;              /* writers over the quota wait instead of ENOSPC */
+    wait_queue_head_t space_wait;  /* writers waiting for room under the quota */
+    atomic64_t reclaimed_bytes;    /* released or saved by the shrinker */
+    scull_stripe *stripes;         /* nr_stripes lock stripes, NULL when not striped */
+    unsigned int nr_stripes;       /* a power of two, fixed for the device's life */
+    struct inode *mapped;          /* first inode mmapped, pinned, holes it maps are zapped when filled */
+    bool zero_mapped;              /* a hole has been mapped to the zero page through it */
+    /* written by every extending write, kept off the read mostly lines above */
+    unsigned long size ____cacheline_aligned_in_smp; /* amount of data stored here, the commit watermark for appends */
+    atomic_long_t tail;            /* end of the last O_APPEND reservation, never below size */
+    spinlock_t append_lock;        /* guards append_holes */
+    struct list_head append_holes; /* killed appends waiting for size to reach them */
 } scull_dev; // struct scull_dev
 
 
+// per open file state, stored in filp->private_data
+// caches the last qset touched so sequential access within a qset
+// skips the xarray lookup
+// threads sharing a file update the cache concurrently, cache_qs is
+// published before cache_gen so a matching gen always means a live qset
+typedef struct scull_file {
+    scull_dev *dev;          /* device this file was opened on */
+    scull_qset *cache_qs;    /* last qset touched */
+    unsigned long cache_gen; /* dev->gen when the cache was filled */
+} scull_file; // struct scull_file
+
+
 // trim functionality to clear the device's memory
-// kernal mode disallows page faults, hence kfree
+// detaches the contents and frees them in the background
+// caller must hold dev->sem for writing
 int scull_trim(struct scull_dev *);
+void scull_trim_flush(void);
+long scull_nr_quanta(struct scull_dev *);
+
+// drop a device's hold on a qset of the given geometry, the last holder
+// frees it, returns how many quanta stopped being charged to the device
+long scull_qset_put(struct scull_dev *, struct scull_qset *, int, int);
+
+// make the second device a copy on write snapshot of the first
+// caller must hold both devices' sem for writing
+int scull_snapshot(struct scull_dev *, struct scull_dev *);
+
+// drop zero page mappings of a hole that was just filled, see scull_vma_fault
+void scull_zap_hole(struct scull_dev *, loff_t, loff_t);
+
+// raise dev->size to at least end, safe against concurrent writers
+// an appender killed before its turn to commit abandons its range instead
+void scull_extend_size(struct scull_dev *, unsigned long);
+void scull_append_abandon(struct scull_dev *, unsigned long, unsigned long);
+
+// create and destroy the qset array slab cache and the workqueue used
+// for background trims and cold scans
+extern struct workqueue_struct *scull_wq;
+int scull_cache_init(void);
+void scull_cache_exit(void);
+
+// quantum page allocation through the device's per cpu pool
+// quanta come back zeroed on the node picked by the device's NUMA policy
+// for the given quantum index, qset arrays come back zeroed
+// the quota is only skipped when forced
+int scull_quantum_node(struct scull_dev *, unsigned long);
+void *scull_alloc_quantum(struct scull_dev *, unsigned long, bool);
+void scull_free_quantum(struct scull_dev *, void *, int);
+long scull_pool_drain(struct scull_dev *);
+long scull_pool_count(struct scull_dev *);
+
+// per device and node quanta accounting, see SCULL_IOC_GET_NUMA_USAGE
+// and the byte quota
+void scull_charge(struct scull_dev *, void *);
+void scull_uncharge(struct scull_dev *, void *);
+bool scull_over_limit(struct scull_dev *);
+void scull_release_quantum(void *);
+
+// page backing byte off of a quantum, folio or vzalloc backed
+struct page *scull_quantum_page(void *, long);
+void **scull_alloc_qset_data(struct scull_dev *, int);
+void scull_free_qset_data(int, void **);
+
+// validate and set the device's NUMA placement policy, see SCULL_NUMA_* in scull_ioctl.h
+int scull_check_numa(int, int);
+int scull_set_numa(struct scull_dev *, int, int);
+
+// validate and apply quantum/qset geometry
+// geometry only changes while the device is empty
+int scull_check_geometry(long, long);
+void scull_set_geometry(struct scull_dev *, int, int);
+
+// look up the item'th qset, trying the file's cache first
+// allocates a missing qset when alloc is set, otherwise returns NULL on a gap
+scull_qset *scull_follow(struct scull_file *, long, bool);
+
+// return the quantum holding byte pos, or NULL for a hole, or an ERR_PTR
+// if a compressed quantum could not be inflated
+// caller must hold dev->sem for reading
+void *scull_get_quantum(struct scull_file *, loff_t);
+
+// return the quantum holding byte pos, allocating it on demand
+// on success the owning qset is returned through the last argument with
+// its lock held, the caller drops it once done writing
+// caller must hold dev->sem for reading
+void *scull_lock_quantum(struct scull_file *, loff_t, struct scull_qset **);
+
+// on a striped device holding dev->sem for writing isn't enough to keep
+// everyone out, every site that takes it for writing takes the stripes
+// right after and drops them right before
+void scull_stripes_lock(struct scull_dev *);
+bool scull_stripes_trylock(struct scull_dev *);
+void scull_stripes_unlock(struct scull_dev *);
+
+// stripe whose sem covers I/O on a byte range, or -1 if dev->sem has to
+long scull_stripe_of(struct scull_dev *, loff_t, size_t);
+
+// fallocate, give [pos, end) its quanta up front so writes there never
+// allocate, or punch it back out, zeroing partial quanta at the edges
+// caller must hold dev->sem for reading, and for writing to punch
+int scull_prealloc(struct scull_file *, loff_t, loff_t);
+int scull_punch_hole(struct scull_file *, loff_t, loff_t);
+
+// offset of the first data (or hole) byte at or after pos for SEEK_DATA/SEEK_HOLE
+// returns -ENXIO when pos is past the end or no data follows
+// caller must hold dev->sem for reading
+loff_t scull_seek_data(struct scull_dev *, loff_t, bool);
 
 
-# endif
\ No newline at end of file
+# endif